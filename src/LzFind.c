@@ -8,25 +8,52 @@
 #include "LzFind.h"
 #include "zopfli/util.h"
 #include "zopfli/match.h"
+#include "threadLocal.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define PREFETCH(addr)
+#endif
+
+/* Hash of the 3 bytes at cur. */
+#define HASH3(cur) ((((cur)[2] | ((UInt32)(cur)[0] << 8)) ^ crc[(cur)[1]]) & 0xFFFF)
+
+//256kb hash, 256kb binary tree, reused by every match finder of this thread
+static thread_local UInt32 poolTables[131072];
+//Position after the last one stored in poolTables
+static thread_local UInt32 poolEnd;
 
 void MatchFinder_Free(CMatchFinder *p)
 {
-  free(p->hash);
+  if (p->hash == poolTables)
+  {
+    poolEnd = p->pos;
+  }
+  else
+  {
+    free(p->hash);
+  }
 }
 
+/* Needs buffer and bufend. Positions start a window above the ones of the last
+use, so old hash entries are out of range and only need to be cleared before the
+positions would overflow. The tree is always written before it is read. */
 void MatchFinder_Create(CMatchFinder *p)
 {
-  //256kb hash, 256kb binary tree
-  p->hash = (UInt32*)malloc(131072 * sizeof(UInt32));
-  if (!p->hash)
+  if (0xFFFFFFFFU - poolEnd < 2 * ZOPFLI_WINDOW_SIZE + (size_t)(p->bufend - p->buffer))
   {
-    exit(1);
+    memset(poolTables, 0, 65536 * sizeof(UInt32));
+    poolEnd = 0;
   }
+  p->hash = poolTables;
   p->son = p->hash + 65536;
 
-  memset(p->hash, 0, 65536 * sizeof(unsigned));
   p->cyclicBufferPos = 0;
-  p->pos = ZOPFLI_WINDOW_SIZE;
+  p->pos = poolEnd + ZOPFLI_WINDOW_SIZE;
 }
 
 static unsigned short * GetMatches(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte *cur, UInt32 *son,
@@ -48,11 +75,7 @@ static unsigned short * GetMatches(UInt32 lenLimit, UInt32 curMatch, UInt32 pos,
     UInt32 len = (len0 < len1 ? len0 : len1);
     if (pb[len] == cur[len])
     {
-      ++len;
-      if (len != lenLimit && pb[len] == cur[len])
-      {
-        len = GetMatch(&cur[len], &pb[len], cur + lenLimit, cur + lenLimit - 8) - cur;
-      }
+      len = GetMatch(&cur[len + 1], &pb[len + 1], cur + lenLimit, cur + lenLimit - 8) - cur;
 
       if (maxLen < len)
       {
@@ -103,10 +126,7 @@ static void SkipMatches(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte
     UInt32 len = (len0 < len1 ? len0 : len1);
     if (pb[len] == cur[len])
     {
-      if (len != lenLimit && pb[len] == cur[len])
-      {
-        len = GetMatch(&cur[len], &pb[len], cur + lenLimit, cur + lenLimit - 8) - cur;
-      }
+      len = GetMatch(&cur[len + 1], &pb[len + 1], cur + lenLimit, cur + lenLimit - 8) - cur;
 
       if (len == lenLimit)
       {
@@ -144,9 +164,11 @@ unsigned short Bt3Zip_MatchFinder_GetMatches(CMatchFinder *p, unsigned short *di
 {
   unsigned lenl = p->bufend - p->buffer; { if (lenl < ZOPFLI_MIN_MATCH) {return 0;}}
   const Byte *cur = p->buffer;
-  UInt32 hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ crc[cur[1]]) & 0xFFFF;
+  UInt32 hashValue = HASH3(cur);
   UInt32 curMatch = p->hash[hashValue];
   p->hash[hashValue] = p->pos;
+  /* The bucket of the next position is a likely cache miss, load it early. */
+  PREFETCH(&p->hash[HASH3(cur + 1)]);
   UInt32 offset = (UInt32)(GetMatches(lenl > ZOPFLI_MAX_MATCH ? ZOPFLI_MAX_MATCH : lenl, curMatch, MF_PARAMS(p), distances, 2) - distances);
   MOVE_POS;
   return offset;
@@ -157,9 +179,10 @@ void Bt3Zip_MatchFinder_Skip(CMatchFinder* p, UInt32 num)
   while (num--)
   {
     const Byte *cur = p->buffer;
-    UInt32 hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ crc[cur[1]]) & 0xFFFF;
+    UInt32 hashValue = HASH3(cur);
     UInt32 curMatch = p->hash[hashValue];
     p->hash[hashValue] = p->pos;
+    PREFETCH(&p->hash[HASH3(cur + 1)]);
     unsigned lenlimit = p->bufend - p->buffer;
     SkipMatches(lenlimit > ZOPFLI_MAX_MATCH ? ZOPFLI_MAX_MATCH : lenlimit, curMatch, MF_PARAMS(p));
     MOVE_POS;
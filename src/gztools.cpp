@@ -7,51 +7,11 @@
 //
 
 #include "gztools.h"
-#include "zlib/zlib.h"
 #include "leanify/zip.h"
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 
-#ifdef _WIN32
-#include <io.h>
-#else
-#include <unistd.h>
-#endif
-
-int ungz(const char * Infile, const char * Outfile){
-    gzFile r = gzopen(Infile, "rb");
-    if (!r){
-        return 1;
-    }
-    FILE * stream = fopen (Outfile, "wb");
-    if (!stream){
-        return 1;
-    }
-    char buf [8192];
-    int bytes;
-    do {
-        bytes = gzread(r, &buf, 8192);
-      if(bytes){
-        fwrite(buf, 1, bytes, stream);
-      }
-      else if (bytes == 0) {
-        break;
-      }
-      else if (bytes < 0) {
-        printf("%s: ungzip error\n", Infile);
-        gzclose_r(r);
-        fclose(stream);
-        unlink(Outfile);
-        return 1;
-      }
-    }
-    while (!gzeof(r));
-    gzclose_r(r);
-    fclose(stream);
-  return 0;
-}
-
 int IsGzip(const char * Infile){
     FILE * stream = fopen (Infile, "rb");
     if (!stream){
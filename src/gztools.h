@@ -11,7 +11,6 @@
 
 #include <stdio.h>
 
-int ungz(const char * Infile, const char * Outfile);
 int IsGzip(const char * Infile);
 int IsZIP(const char * Infile);
 #endif /* defined(__Efficient_Compression_Tool__ungz__) */
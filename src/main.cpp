@@ -44,6 +44,7 @@ static void Usage() {
             "Usage: ECT [Options] Files/Folders...\n"
             "Options:\n"
             " -1 to -9          Set compression level (Default: 3)\n"
+            "                   -1 uses a fast lazy matcher for GZIP and ZIP\n"
             " -strip            Strip metadata\n"
             " -progressive      Use progressive encoding for JPEGs\n"
             " -autorotate       Automatically rotate JPEGs, when perfectly transformable\n"
@@ -62,11 +63,15 @@ static void Usage() {
             " --allfilters      Try all PNG filter modes\n"
             " --allfilters-b    Try all PNG filter modes, including brute force strategies\n"
             " --pal_sort=i      Try i different PNG palette filtering strategies (up to 120)\n"
+            " --checkpoint=dir  Save GZIP/ZIP progress to dir, rerunning resumes from it\n"
+            " --gzip-members    Keep the members of multi-member GZIP files instead of merging them\n"
 #ifndef NOMULTI
             " --mt-deflate      Use per block multithreading in Deflate\n"
             " --mt-deflate=i    Use per block multithreading in Deflate with i threads\n"
             " --mt-file         Use per file multithreading\n"
             " --mt-file=i       Use per file multithreading with i threads\n"
+            " --mt-chunks       Compress GZIP/ZIP input as independent 32 MB chunks in parallel\n"
+            " --mt-chunks=i     Compress GZIP/ZIP input as independent i MB chunks in parallel\n"
 #endif
             //" --arithmetic   Use arithmetic encoding for JPEGs, incompatible with most software\n"
 #ifdef __DATE__
@@ -133,7 +138,7 @@ static void ECT_ReportSavings(){
     }
 }
 
-static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multithreading, long long fs, unsigned ZIP, int strict){
+static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multithreading, long long fs, unsigned ZIP, int strict, const char* checkpoint, unsigned chunksize, unsigned members){
     if (!fs){
         printf("%s: Compression of empty files is currently not supported\n", Infile);
         return 2;
@@ -147,30 +152,34 @@ static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multi
         return 2;
     }
     if (ZIP || !isGZ){
-        if (exists(((std::string)Infile).append(ZIP ? ".zip" : ".gz").c_str())){
+        std::string Outfile = ((std::string)Infile).append(ZIP ? ".zip" : ".gz");
+        if (exists(Outfile.c_str())){
             printf("%s: Compressed file already exists\n", Infile);
             return 2;
         }
-        ZopfliGzip(Infile, 0, Mode, multithreading, ZIP);
+        //Renamed once complete, so an interrupted run leaves no Outfile that would block resuming it
+        std::string Partfile = Outfile + ".part";
+        if (ZopfliGzip(Infile, Partfile.c_str(), Mode, multithreading, ZIP, checkpoint, chunksize)){
+            unlink(Partfile.c_str());
+            return 2;
+        }
+        RenameAndReplace(Partfile.c_str(), Outfile.c_str());
         return 1;
     }
-    if (exists(((std::string)Infile).append(".ungz").c_str())){
-        return 2;
-    }
-    if (exists(((std::string)Infile).append(".ungz.gz").c_str())){
+    //With a checkpoint, this is left over from the interrupted run.
+    if (!checkpoint && exists(((std::string)Infile).append(".ungz.gz").c_str())){
         return 2;
     }
-    if(ungz(Infile, ((std::string)Infile).append(".ungz").c_str())){
+    if (ZopfliRecompressGzip(Infile, ((std::string)Infile).append(".ungz.gz").c_str(), Mode, multithreading, checkpoint, chunksize, members, strict)){
+        unlink(((std::string)Infile).append(".ungz.gz").c_str());
         return 2;
     }
-    ZopfliGzip(((std::string)Infile).append(".ungz").c_str(), 0, Mode, multithreading, ZIP);
     if (filesize(((std::string)Infile).append(".ungz.gz").c_str()) < filesize(Infile)){
         RenameAndReplace(((std::string)Infile).append(".ungz.gz").c_str(), Infile);
     }
     else {
         unlink(((std::string)Infile).append(".ungz.gz").c_str());
     }
-    unlink(((std::string)Infile).append(".ungz").c_str());
     return 0;
 }
 
@@ -317,7 +326,9 @@ unsigned fileHandler(const char * Infile, const ECTOptions& Options, int interna
             return 1;
         }
         int statcompressedfile = 0;
-        if (size < 1200000000) {//completely random value
+        int isImage = x == "PNG" || x == "png" || x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg";
+        //Images are loaded into memory, gzip and zip input is streamed
+        if (size < 1200000000 || !isImage) {//completely random value
             if (x == "PNG" || x == "png"){
                 error = OptimizePNG(Infile, Options);
             }
@@ -325,7 +336,7 @@ unsigned fileHandler(const char * Infile, const ECTOptions& Options, int interna
                 error = OptimizeJPEG(Infile, Options);
             }
             else if (Options.Gzip && !internal){
-                statcompressedfile = ECTGzip(Infile, Options.Mode, Options.DeflateMultithreading, size, Options.Zip, Options.Strict);
+                statcompressedfile = ECTGzip(Infile, Options.Mode, Options.DeflateMultithreading, size, Options.Zip, Options.Strict, Options.Checkpoint, Options.ChunkSize, Options.GzipMembers);
                 if (statcompressedfile == 2){
                     return 1;
                 }
@@ -532,6 +543,9 @@ int main(int argc, const char * argv[]) {
     Options.Allfilterscheap = 0;
     Options.palette_sort = 0;
     Options.keep = false;
+    Options.Checkpoint = 0;
+    Options.ChunkSize = 0;
+    Options.GzipMembers = false;
     std::vector<int> args;
     int files = 0;
     if (argc >= 2){
@@ -592,10 +606,26 @@ int main(int argc, const char * argv[]) {
                     Options.FileMultithreading = std::thread::hardware_concurrency();
                 }
             }
+            else if (strncmp(argv[i], "--mt-chunks", 11) == 0) {
+                if (strncmp(argv[i], "--mt-chunks=", 12) == 0){
+                    int megabytes = atoi(argv[i] + 12);
+                    Options.ChunkSize = (unsigned)(megabytes < 1 ? 1 : megabytes > 4095 ? 4095 : megabytes) << 20;
+                }
+                else if (strcmp(argv[i], "--mt-chunks") == 0) {
+                    Options.ChunkSize = 32 << 20;
+                }
+            }
 #endif
+            else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {Options.Checkpoint = argv[i] + 13;}
+            else if (strcmp(argv[i], "--gzip-members") == 0) {Options.GzipMembers = true;}
             else if (strcmp(argv[i], "--arithmetic") == 0) {Options.Arithmetic = true;}
             else {printf("Unknown flag: %s\n", argv[i]); return 0;}
         }
+#ifndef NOMULTI
+        if(Options.ChunkSize && !Options.DeflateMultithreading){
+            Options.DeflateMultithreading = std::thread::hardware_concurrency();
+        }
+#endif
         if(Options.Autorotate > 0) {
             if (!Options.strip) {printf("Flag -autorotate requires -strip\n"); return 0;}
         }
@@ -36,12 +36,16 @@ struct ECTOptions{
   int DeflateMultithreading;
   int FileMultithreading;
   bool keep;
+  const char* Checkpoint;
+  unsigned ChunkSize;
+  bool GzipMembers;
 };
 
 int Optipng(unsigned level, const char * Infile, bool force_no_palette, unsigned clean_alpha);
 int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned quiet);
 int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorotate, const char * Infile, const char * Outfile, size_t* stripped_outsize);
-int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, unsigned ZIP);
+int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, unsigned ZIP, const char* checkpoint, unsigned chunksize);
+int ZopfliRecompressGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, const char* checkpoint, unsigned chunksize, unsigned members, int strict);
 void ZopfliBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
 unsigned fileHandler(const char * Infile, const ECTOptions& Options, int internal);
 unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const ECTOptions& Options);
@@ -0,0 +1,460 @@
+/*
+Copyright 2011 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Author: lode.vandevenne@gmail.com (Lode Vandevenne)
+Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
+*/
+
+/*Modified by Felix Hanau*/
+
+#include "blocksplitter.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "deflate.h"
+#include "lz77.h"
+#include "util.h"
+
+#include <algorithm>
+#ifndef NOMULTI
+#include <thread>
+#include <vector>
+#endif
+
+/* Distance between the checkpoints of the cumulative symbol histograms. */
+#define HISTOGRAM_STEP 1024
+/* Entries per checkpoint: 288 lit/len counts followed by 32 dist counts. */
+#define HISTOGRAM_SIZE 320
+
+typedef struct SplitCostContext {
+  /* The LZ77 data, possibly spread over several consecutive stores. */
+  const ZopfliLZ77Store* stores;
+  size_t nstores;
+  /* Index of the first symbol of every store, followed by the total size. */
+  const size_t* offsets;
+  size_t start;
+  size_t end;
+  /* Symbol counts of the LZ77 data before every HISTOGRAM_STEP'th symbol. */
+  const unsigned* histograms;
+} SplitCostContext;
+
+/* Adds delta to the counts of the symbols in the range start-end of store. */
+static void AddStoreCounts(const ZopfliLZ77Store* store, size_t start, size_t end, size_t delta, size_t* counts) {
+  size_t* d_counts = counts + 288;
+  if (store->symbols){
+    const unsigned char* distc = (const unsigned char*)store->dists;
+    for (size_t i = start; i < end; i++) {
+      counts[store->litlens[i] & 511] += delta;
+      if (distc[i]) d_counts[distc[i] - 1] += delta;
+    }
+  }
+  else{
+    for (size_t i = start; i < end; i++) {
+      if (store->dists[i]) {
+        counts[ZopfliGetLengthSymbol(store->litlens[i])] += delta;
+        d_counts[ZopfliGetDistSymbol(store->dists[i])] += delta;
+      }
+      else {
+        counts[store->litlens[i]] += delta;
+      }
+    }
+  }
+}
+
+/*
+Adds delta to the counts of the symbols in the LZ77 range start-end. counts is
+laid out like a checkpoint of the histograms. Wraps around on purpose when
+subtracting.
+*/
+static void AddSymbolCounts(const SplitCostContext* c, size_t start, size_t end, size_t delta, size_t* counts) {
+  if (start >= end) return;
+  size_t s = std::upper_bound(c->offsets, c->offsets + c->nstores, start) - c->offsets - 1;
+  for (; start < end; s++) {
+    size_t send = c->offsets[s + 1] < end ? c->offsets[s + 1] : end;
+    AddStoreCounts(&c->stores[s], start - c->offsets[s], send - c->offsets[s], delta, counts);
+    start = send;
+  }
+}
+
+/*
+Builds the cumulative symbol histograms of the whole LZ77 data, one checkpoint
+every HISTOGRAM_STEP symbols.
+*/
+static unsigned* BuildHistograms(const SplitCostContext* c, size_t llsize) {
+  size_t ncheckpoints = llsize / HISTOGRAM_STEP + 1;
+  unsigned* histograms = (unsigned*)malloc(ncheckpoints * HISTOGRAM_SIZE * sizeof(unsigned));
+  if (!histograms) exit(1);
+  size_t counts[HISTOGRAM_SIZE] = {0};
+  for (size_t j = 0; j < ncheckpoints; j++) {
+    if (j) {
+      AddSymbolCounts(c, (j - 1) * HISTOGRAM_STEP, j * HISTOGRAM_STEP, 1, counts);
+    }
+    for (size_t k = 0; k < HISTOGRAM_SIZE; k++) {
+      histograms[j * HISTOGRAM_SIZE + k] = counts[k];
+    }
+  }
+  return histograms;
+}
+
+/*
+Gets the same counts as ZopfliLZ77Counts for the LZ77 range start-end, from the
+nearest checkpoints inside the range plus the symbols left over at both ends.
+Counts the symbols directly if there are no histograms.
+*/
+static void RangeCounts(const SplitCostContext* c, size_t start, size_t end, size_t* ll_count, size_t* d_count) {
+  size_t counts[HISTOGRAM_SIZE];
+  size_t first = (start + HISTOGRAM_STEP - 1) / HISTOGRAM_STEP;
+  size_t last = end / HISTOGRAM_STEP;
+  if (first >= last || !c->histograms) {
+    for (size_t k = 0; k < HISTOGRAM_SIZE; k++) {
+      counts[k] = 0;
+    }
+    AddSymbolCounts(c, start, end, 1, counts);
+  }
+  else {
+    const unsigned* a = c->histograms + first * HISTOGRAM_SIZE;
+    const unsigned* b = c->histograms + last * HISTOGRAM_SIZE;
+    for (size_t k = 0; k < HISTOGRAM_SIZE; k++) {
+      counts[k] = b[k] - a[k];
+    }
+    AddSymbolCounts(c, start, first * HISTOGRAM_STEP, 1, counts);
+    AddSymbolCounts(c, last * HISTOGRAM_STEP, end, 1, counts);
+  }
+  for (size_t k = 0; k < 288; k++) {
+    ll_count[k] = counts[k];
+  }
+  for (size_t k = 0; k < 30; k++) {
+    d_count[k] = counts[288 + k];
+  }
+  d_count[30] = d_count[31] = 0;
+  ll_count[256] = 1;  /* End symbol. */
+}
+
+/*
+ Gets the cost which is the sum of the cost of the left and the right section
+ of the data.
+ */
+static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext, unsigned entropysplit, const size_t* ll_count, const size_t* d_count) {
+  double result = 3;
+  unsigned ll_lengths[288];
+  unsigned d_lengths[32];
+  unsigned dummy;
+  if(i == c->end){
+    result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_count, d_count) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_count, d_count);
+    result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+    return result;
+  }
+  size_t ll_counts[288];
+  size_t d_counts[32];
+  RangeCounts(c, c->start, i, ll_counts, d_counts);
+
+  result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
+  result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+  result += 3;
+  for(size_t ix = 0; ix < 286; ix++){
+    ll_counts[ix] = ll_count[ix] - ll_counts[ix];
+  }
+  for(size_t ix = 0; ix < 30; ix++){
+    d_counts[ix] = d_count[ix] - d_counts[ix];
+  }
+  ll_counts[256] = 1;
+  result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
+  result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+  return result;
+}
+
+/*
+Evaluates SplitCost at the n points in p whose todo flag is set, storing the
+results in vp. Uses up to threads threads.
+*/
+static void EvaluateSplitCosts(const size_t* p, double* vp, const unsigned char* todo, size_t n, SplitCostContext* context, const ZopfliOptions* options, unsigned threads, const size_t* ll_count, const size_t* d_count) {
+  auto evaluate = [=](unsigned first, unsigned step) {
+    for (size_t i = first; i < n; i += step) {
+      if (todo[i]) {
+        vp[i] = SplitCost(p[i], context, options->searchext & 2, options->entropysplit, ll_count, d_count);
+      }
+    }
+  };
+#ifndef NOMULTI
+  if (threads > n) {
+    threads = n;
+  }
+  if (threads > 1) {
+    std::vector<std::thread> helpers;
+    for (unsigned t = 1; t < threads; t++) {
+      helpers.emplace_back(evaluate, t, threads);
+    }
+    evaluate(0, threads);
+    for (std::thread& t : helpers) {
+      t.join();
+    }
+    return;
+  }
+#else
+  (void)threads;
+#endif
+  evaluate(0, 1);
+}
+
+/*
+Finds minimum of function f(i) where is is of type size_t, f(i) is of type
+double, i is in range start-end (excluding end).
+The candidate points of each round are evaluated on up to threads threads.
+*/
+static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, unsigned char* enough, const ZopfliOptions* options, unsigned threads) {
+  //Count LZ77 symbols of the whole range once, the right part of a split is derived from it
+  size_t ll_count[288];
+  size_t d_count[32];
+  RangeCounts(context, context->start, context->end, ll_count, d_count);
+
+  size_t startsize = end - start;
+  /* Try to find minimum by recursively checking multiple points. */
+#define NUM 9  /* Good value: 9. */
+  size_t i;
+  size_t p[NUM];
+  double vp[NUM];
+  unsigned char todo[NUM];
+  double prevstore = -1;
+  size_t besti;
+  double best = ZOPFLI_LARGE_FLOAT;
+  double lastbest = ZOPFLI_LARGE_FLOAT;
+  size_t pos = start;
+  size_t ostart = start;
+  for (;;) {
+    if (end - start <= options->num){
+      if (options->numiterations > 50){
+        for (unsigned j = 0; j < end - start; j++){
+          p[j] = start + j;
+          todo[j] = 1;
+        }
+        EvaluateSplitCosts(p, vp, todo, end - start, context, options, threads, ll_count, d_count);
+        for (unsigned j = 0; j < end - start; j++){
+          if (vp[j] < best){
+            best = vp[j];
+            pos = start + j;
+          }
+        }
+      }
+      break;
+    }
+    if (end - start <= startsize/100 && startsize > 600 && options->num == 3) break;
+
+    for (i = 0; i < options->num; i++) {
+      p[i] = start + (i + 1) * ((end - start) / (options->num + 1));
+      todo[i] = !(pos == p[i] || (i == (options->num - 1) / 2 && prevstore != -1 && options->num == 3));
+      if (!todo[i]){
+        vp[i] = best;
+      }
+    }
+    EvaluateSplitCosts(p, vp, todo, options->num, context, options, threads, ll_count, d_count);
+    besti = 0;
+    best = vp[0];
+    prevstore = best;
+    for (i = 1; i < options->num; i++) {
+      if (vp[i] < best) {
+        best = vp[i];
+        besti = i;
+      }
+    }
+    if (best > lastbest) break;
+
+    start = besti == 0 ? start : p[besti - 1];
+    end = besti == options->num - 1 ? end : p[besti + 1];
+
+    pos = p[besti];
+    lastbest = best;
+  }
+  double origcost = SplitCost(context->end, context, options->searchext & 2, options->entropysplit, ll_count, d_count);
+  if(origcost <= best){
+    pos = ostart;
+  }
+  else if (options->entropysplit && best + 200 >= origcost){
+    *enough = 1;
+  }
+  return pos;
+#undef NUM
+}
+
+/*
+Splits the LZ77 range lstart-lend and, recursively, the resulting halves, until
+no further split reduces the cost or a range gets smaller than noblocksplitlz.
+Each range only depends on its own data, so once a split is found the right
+half is searched on another thread while threads remain.
+last: whether the range is the last one of the LZ77 data. Apart from the
+initial range, its end is excluded from the search.
+points: dynamic array the found split points are appended to, unsorted.
+*/
+static void SplitLZ77Range(const SplitCostContext* base, size_t lstart, size_t lend, int last,
+                           const ZopfliOptions* options, unsigned threads,
+                           size_t** points, size_t* npoints) {
+  SplitCostContext c = *base;
+  c.start = lstart;
+  c.end = lend;
+  assert(lstart < lend);
+  unsigned char enough = 0;
+  size_t llpos = FindMinimum(&c, lstart + 1, lend, &enough, options, threads);
+  assert(llpos > lstart || !llpos);
+  assert(llpos < lend);
+
+  if (llpos == lstart + 1 || llpos == lend) {
+    return;  /* No further split will probably reduce compression. */
+  }
+  ZOPFLI_APPEND_DATA(llpos, points, npoints);
+
+  size_t rend = last ? base->end - 1 : lend;
+  int left = llpos - lstart >= options->noblocksplitlz;
+  int right = !enough && rend > llpos && rend - llpos >= options->noblocksplitlz;
+#ifndef NOMULTI
+  if (left && right && threads > 1) {
+    size_t* rpoints = 0;
+    size_t nrpoints = 0;
+    std::thread helper(SplitLZ77Range, base, llpos, rend, last, options, threads / 2, &rpoints, &nrpoints);
+    SplitLZ77Range(base, lstart, llpos, 0, options, threads - threads / 2, points, npoints);
+    helper.join();
+    for (size_t i = 0; i < nrpoints; i++) {
+      ZOPFLI_APPEND_DATA(rpoints[i], points, npoints);
+    }
+    free(rpoints);
+    return;
+  }
+#endif
+  if (left) {
+    SplitLZ77Range(base, lstart, llpos, 0, options, threads, points, npoints);
+  }
+  if (right) {
+    SplitLZ77Range(base, llpos, rend, last, options, threads, points, npoints);
+  }
+}
+
+/* Sets up c for the n stores. offsets needs room for n + 1 entries. */
+static void InitSplitCostContext(SplitCostContext* c, const ZopfliLZ77Store* stores, size_t n, size_t* offsets) {
+  offsets[0] = 0;
+  for (size_t i = 0; i < n; i++) {
+    offsets[i + 1] = offsets[i] + stores[i].size;
+  }
+  c->stores = stores;
+  c->nstores = n;
+  c->offsets = offsets;
+  c->start = 0;
+  c->end = offsets[n];
+  c->histograms = 0;
+}
+
+/* Finds the split points of the LZ77 data of c and builds its histograms. */
+static void SplitLZ77(SplitCostContext* c, size_t** splitpoints, size_t* npoints, const ZopfliOptions* options) {
+  if (c->end < options->noblocksplitlz) return;  /* This code fails on tiny files. */
+
+  c->histograms = BuildHistograms(c, c->end);
+  SplitLZ77Range(c, 0, c->end, 1, options, options->multithreading, splitpoints, npoints);
+  std::sort(*splitpoints, *splitpoints + *npoints);
+}
+
+void ZopfliBlockSplitLZ77(const unsigned short* litlens,
+                          const unsigned short* dists,
+                          size_t llsize, size_t** splitpoints,
+                          size_t* npoints, const ZopfliOptions* options, unsigned char symbols) {
+  ZopfliLZ77Store store;
+  store.litlens = (unsigned short*)litlens;
+  store.dists = (unsigned short*)dists;
+  store.size = llsize;
+  store.symbols = symbols;
+  size_t offsets[2];
+  SplitCostContext c;
+  InitSplitCostContext(&c, &store, 1, offsets);
+  SplitLZ77(&c, splitpoints, npoints, options);
+  free((void*)c.histograms);
+}
+
+/* Like GetStatistics for the LZ77 range start-end. */
+static void RangeStatistics(const SplitCostContext* c, size_t start, size_t end, SymbolStats* stats) {
+  RangeCounts(c, start, end, stats->litlens, stats->dists);
+  CalculateStatistics(stats);
+}
+
+static unsigned symtox(unsigned lls){
+  if (lls <= 279){
+    return 0;
+  }
+  if (lls <= 283){
+    return 100;
+  }
+  return 200;
+}
+
+void ZopfliBlockSplit(const ZopfliOptions* options,
+                      const unsigned char* in, size_t instart, size_t inend,
+                      size_t** splitpoints, size_t* npoints, SymbolStats** stats, unsigned char twiceMode, ZopfliLZ77Segments* twice) {
+  size_t* lz77splitpoints = 0;
+  size_t nlz77points = 0;
+  size_t prevpoints = *npoints;
+  ZopfliLZ77Store store;
+  const ZopfliLZ77Store* stores = &store;
+  size_t nstores = 1;
+
+  /* Unintuitively, Using a simple LZ77 method here instead of ZopfliLZ77Optimal
+  results in better blocks. */
+  ZopfliInitLZ77Store(&store);
+  if (!(twiceMode & 2)){
+    ZopfliLZ77Lazy(options, in, instart, inend, &store, 1);
+    store.symbols = 1;
+  }
+  else{
+    stores = twice->stores;
+    nstores = twice->n;
+  }
+  size_t* offsets = (size_t*)malloc((nstores + 1) * sizeof(size_t));
+  if (!offsets) exit(1);
+  SplitCostContext c;
+  InitSplitCostContext(&c, stores, nstores, offsets);
+
+  /* Blocksplitting likely wont improve compression on small files */
+  if (inend - instart >= options->noblocksplit){
+    SplitLZ77(&c, &lz77splitpoints, &nlz77points, options);
+  }
+
+  *stats = (SymbolStats*)realloc(*stats, (nlz77points + prevpoints + 1) * sizeof(SymbolStats));
+  if (!(*stats)){
+    exit(1);
+  }
+
+  /* Convert LZ77 positions to positions in the uncompressed input. */
+  size_t pos = instart;
+  size_t k = 0;
+  for (size_t s = 0, i = 0; s < nstores && k < nlz77points; s++) {
+    const ZopfliLZ77Store* st = &stores[s];
+    for (size_t j = 0; j < st->size; j++, i++) {
+      if (lz77splitpoints[k] == i) {
+        RangeStatistics(&c, k ? lz77splitpoints[k - 1] : 0, i, &((*stats)[*npoints]));
+        ZOPFLI_APPEND_DATA(pos, splitpoints, npoints);
+        if (++k == nlz77points) break;
+      }
+      pos += st->symbols ? st->litlens[j] < 256 ? 1 : symtox(st->litlens[j] & 511) + (st->litlens[j] >> 9) : st->dists[j] == 0 ? 1 : st->litlens[j];
+    }
+  }
+  assert(k == nlz77points);
+  RangeStatistics(&c, k ? lz77splitpoints[k - 1] : 0, c.end, &((*stats)[*npoints]));
+
+  free((void*)c.histograms);
+  free(offsets);
+  free(lz77splitpoints);
+  if (twiceMode & 2){
+    ZopfliCleanLZ77Segments(twice);
+  }
+  else{
+    ZopfliCleanLZ77Store(&store);
+  }
+}
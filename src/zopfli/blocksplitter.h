@@ -51,9 +51,21 @@ splitpoints: dynamic array to put the resulting split point coordinates into.
   The coordinates are indices in the input array.
 npoints: pointer to amount of splitpoints, for the dynamic array. The amount of
   blocks is the amount of splitpoitns + 1.
+twice: if twiceMode & 2, the LZ77 data to split instead of a lazy parse. It is
+  freed.
 */
 void ZopfliBlockSplit(const ZopfliOptions* options, const unsigned char* in, size_t instart,
-                      size_t inend, size_t** splitpoints, size_t* npoints, SymbolStats** stats, unsigned char twiceMode, ZopfliLZ77Store twiceStore);
+                      size_t inend, size_t** splitpoints, size_t* npoints, SymbolStats** stats, unsigned char twiceMode, ZopfliLZ77Segments* twice);
+
+/*
+Does blocksplitting on LZ77 data.
+The output splitpoints are indices in the LZ77 data.
+symbols: whether the LZ77 data is stored as symbols.
+*/
+void ZopfliBlockSplitLZ77(const unsigned short* litlens,
+                          const unsigned short* dists,
+                          size_t llsize, size_t** splitpoints,
+                          size_t* npoints, const ZopfliOptions* options, unsigned char symbols);
 
 #ifdef __cplusplus
 }
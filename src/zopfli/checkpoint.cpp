@@ -0,0 +1,172 @@
+/*
+Checkpoints for resuming interrupted compressions, see checkpoint.h.
+
+The file starts with a magic and the key of the compression. It is followed by
+one record per saved master block:
+  u64 input position, u64 offset and u64 size of the bytes of the deflate
+  stream the record contains, u8 bit pointer, the bytes, and a u64 hash of all
+  of the above.
+A record rewrites the partial last byte of the previous one. Records that are
+cut off or don't match their hash are ignored, so a run interrupted while
+saving resumes at the previous record.
+*/
+
+#include "checkpoint.h"
+
+#include <stddef.h>
+#include <string.h>
+
+static const char magic[8] = {'E', 'C', 'T', 'C', 'K', 'P', 'T', '2'};
+
+static unsigned long long HashBytes(unsigned long long hash, const void* data, size_t size) {
+  const unsigned char* p = (const unsigned char*)data;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    unsigned long long v;
+    memcpy(&v, p + i, 8);
+    hash = (hash ^ v) * 0x100000001B3ULL;
+  }
+  for (; i < size; i++) {
+    hash = (hash ^ p[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+typedef struct RecordHeader {
+  unsigned long long pos;
+  unsigned long long offset;
+  unsigned long long size;
+  unsigned char bp;
+} RecordHeader;
+
+static int ReadRecord(FILE* file, RecordHeader* h, unsigned char** data) {
+  if (fread(&h->pos, 8, 1, file) != 1 || fread(&h->offset, 8, 1, file) != 1
+      || fread(&h->size, 8, 1, file) != 1 || fread(&h->bp, 1, 1, file) != 1
+      || h->size > ((size_t)-1) / 2) {
+    return 0;
+  }
+  *data = (unsigned char*)malloc(h->size + 1);
+  if (!*data){
+    exit(1);
+  }
+  unsigned long long hash;
+  if (fread(*data, 1, h->size, file) != h->size || fread(&hash, 8, 1, file) != 1) {
+    return 0;
+  }
+  unsigned long long check = HashBytes(0xCBF29CE484222325ULL, &h->pos, 8);
+  check = HashBytes(check, &h->offset, 8);
+  check = HashBytes(check, &h->size, 8);
+  check = HashBytes(check, &h->bp, 1);
+  check = HashBytes(check, *data, h->size);
+  return check == hash;
+}
+
+size_t ZopfliCheckpointOpen(ZopfliCheckpoint* c, const ZopfliOptions* options,
+                            const unsigned char* in, size_t insize,
+                            unsigned char* bp, unsigned char** out, size_t* outsize) {
+  c->file = 0;
+  c->path = 0;
+  c->outstart = *outsize;
+  c->saved = 0;
+  if (!options->checkpoint || *bp) {
+    return 0;
+  }
+
+  /* The key covers the input and all options up to chunksize, but not the
+  uninitialized padding before the checkpoint directory. */
+  unsigned long long key = HashBytes(0xCBF29CE484222325ULL, &insize, sizeof(insize));
+  key = HashBytes(key, options, offsetof(ZopfliOptions, chunksize) + sizeof(options->chunksize));
+  key = HashBytes(key, in, insize);
+
+  size_t dirlen = strlen(options->checkpoint);
+  c->path = (char*)malloc(dirlen + 32);
+  if (!c->path){
+    exit(1);
+  }
+  snprintf(c->path, dirlen + 32, "%s/%016llx.ckpt", options->checkpoint, key);
+
+  size_t pos = 0;
+  c->file = fopen(c->path, "r+b");
+  char filemagic[8];
+  unsigned long long filekey;
+  if (c->file && fread(filemagic, 8, 1, c->file) == 1 && !memcmp(filemagic, magic, 8)
+      && fread(&filekey, 8, 1, c->file) == 1 && filekey == key) {
+    long valid = ftell(c->file);
+    RecordHeader h;
+    unsigned char* data = 0;
+    while (ReadRecord(c->file, &h, &data) && h.offset <= *outsize - c->outstart) {
+      *outsize = c->outstart + h.offset;
+      (*out) = (unsigned char*)realloc(*out, *outsize + h.size + 1);
+      if (!(*out)){
+        exit(1);
+      }
+      memcpy(*out + *outsize, data, h.size);
+      *outsize += h.size;
+      *bp = h.bp;
+      pos = h.pos;
+      c->saved = *outsize - c->outstart - (h.bp != 0);
+      valid = ftell(c->file);
+      free(data);
+      data = 0;
+    }
+    free(data);
+    /* Later records overwrite what is left of an interrupted save. */
+    fseek(c->file, valid, SEEK_SET);
+    return pos;
+  }
+
+  if (c->file) {
+    fclose(c->file);
+  }
+  c->file = fopen(c->path, "wb");
+  if (!c->file || fwrite(magic, 8, 1, c->file) != 1 || fwrite(&key, 8, 1, c->file) != 1
+      || fflush(c->file)) {
+    fprintf(stderr, "Can't write checkpoint %s\n", c->path);
+    if (c->file) {
+      fclose(c->file);
+      c->file = 0;
+    }
+  }
+  return 0;
+}
+
+void ZopfliCheckpointSave(ZopfliCheckpoint* c, size_t pos, unsigned char bp,
+                          const unsigned char* out, size_t outsize) {
+  if (!c->file) {
+    return;
+  }
+  RecordHeader h;
+  h.pos = pos;
+  h.offset = c->saved;
+  h.size = outsize - c->outstart - c->saved;
+  h.bp = bp;
+  const unsigned char* data = out + c->outstart + c->saved;
+
+  unsigned long long hash = HashBytes(0xCBF29CE484222325ULL, &h.pos, 8);
+  hash = HashBytes(hash, &h.offset, 8);
+  hash = HashBytes(hash, &h.size, 8);
+  hash = HashBytes(hash, &h.bp, 1);
+  hash = HashBytes(hash, data, h.size);
+  if (fwrite(&h.pos, 8, 1, c->file) != 1 || fwrite(&h.offset, 8, 1, c->file) != 1
+      || fwrite(&h.size, 8, 1, c->file) != 1 || fwrite(&h.bp, 1, 1, c->file) != 1
+      || fwrite(data, 1, h.size, c->file) != h.size || fwrite(&hash, 8, 1, c->file) != 1
+      || fflush(c->file)) {
+    fprintf(stderr, "Can't write checkpoint %s\n", c->path);
+    fclose(c->file);
+    c->file = 0;
+    return;
+  }
+  c->saved = outsize - c->outstart - (bp != 0);
+}
+
+void ZopfliCheckpointClose(ZopfliCheckpoint* c) {
+  if (c->file) {
+    fclose(c->file);
+  }
+  if (c->path) {
+    remove(c->path);
+  }
+  free(c->path);
+  c->file = 0;
+  c->path = 0;
+}
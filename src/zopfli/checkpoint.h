@@ -0,0 +1,41 @@
+/*
+Checkpoints let an interrupted compression resume at the last completed master
+block. The deflate stream written so far and the bit pointer are appended to a
+file in options->checkpoint after every master block. Master blocks are
+compressed independently, so nothing else needs to be saved. The file name is
+derived from the input and the options, so a checkpoint is only used for the
+same compression.
+*/
+
+#ifndef ZOPFLI_CHECKPOINT_H_
+#define ZOPFLI_CHECKPOINT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "zopfli.h"
+
+typedef struct ZopfliCheckpoint {
+  FILE* file;  /* 0 if checkpoints are disabled or the file can't be written. */
+  char* path;
+  size_t outstart;  /* Start of the deflate stream in the output. */
+  size_t saved;  /* Amount of complete bytes of the deflate stream that are saved. */
+} ZopfliCheckpoint;
+
+/*
+Opens the checkpoint for compressing in with options and restores its progress:
+the saved deflate stream is appended to out and bp is set. Returns the input
+position to continue at, 0 if there is no checkpoint.
+*/
+size_t ZopfliCheckpointOpen(ZopfliCheckpoint* c, const ZopfliOptions* options,
+                            const unsigned char* in, size_t insize,
+                            unsigned char* bp, unsigned char** out, size_t* outsize);
+
+/* Saves the progress after the input up to pos has been compressed. */
+void ZopfliCheckpointSave(ZopfliCheckpoint* c, size_t pos, unsigned char bp,
+                          const unsigned char* out, size_t outsize);
+
+/* Closes and removes the checkpoint once the compression is complete. */
+void ZopfliCheckpointClose(ZopfliCheckpoint* c);
+
+#endif  /* ZOPFLI_CHECKPOINT_H_ */
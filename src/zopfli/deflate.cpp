@@ -25,17 +25,21 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "lz77.h"
 #include "squeeze.h"
 #include "katajainen.h"
+#include "checkpoint.h"
+#include "../threadLocal.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <math.h>
+#include <string.h>
 
 #ifndef NOMULTI
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include <vector>
-#include <mutex>
 #endif
 
 /*
@@ -45,59 +49,51 @@ Given the value of bp and the amount of bytes, the amount of bits represented
 is not simply bytesize * 8 + bp because even representing one bit requires a
 whole byte. It is: (bp == 0) ? (bytesize * 8) : ((bytesize - 1) * 8 + bp)
 */
-static void AddBit(int bit,
-                   unsigned char* bp, unsigned char** out, size_t* outsize) {
-  if (*bp == 0) {(*outsize)++;}
-  (*out)[*outsize - 1] |= bit << *bp;
-  *bp = (*bp + 1) & 7;
-}
 
-static void AddBits(unsigned symbol, unsigned length,
-                    unsigned char* bp, unsigned char* out, size_t* outsize) {
-//Needs:
-  //1. 32-bit arch
-  //2. 32-bit unaligned read/write
-  //3. Little endian architecture
-//As this code is not that much faster it should be ok to only enable it on x86 with MSVC, GCC and clang
-#if defined(__i386__) || defined(_M_IX86) || defined(__x86_64__) || defined(_M_X64)
-  //Length must be nonzero.
-    *(unsigned*)(&(out[*outsize - (!!(*bp))])) |= (symbol << (*bp));
-    (*outsize) += ((*bp) + length - 1) / 8 + (!(*bp));
-    *bp = (((*bp) + length) & 7);
+/*
+Writes the deflate bitstream LSB first through a 64-bit accumulator that is
+stored 4 bytes at a time. Huffman codes must be passed bit reversed, as they
+come from ZopfliLengthsToSymbols. The byte stores are merged into one store by
+the compiler on little endian targets and need no unaligned access elsewhere.
+*/
+typedef struct BitWriter {
+  unsigned char* out;
+  size_t pos;  /* Bytes stored so far. */
+  unsigned long long buf;
+  unsigned count;  /* Bits in buf, below 32 between calls. */
+} BitWriter;
+
+/* Continues writing at the position given by bp and outsize. */
+static void BitWriterInit(BitWriter* w, unsigned char* out, size_t outsize, unsigned char bp) {
+  w->out = out;
+  w->pos = outsize - (bp != 0);
+  w->buf = bp ? out[w->pos] & ((1u << bp) - 1) : 0;
+  w->count = bp;
 }
 
-//Like AddBits, but uses "bits" for posititon
-static void AddBits2(unsigned symbol, unsigned length,
-                     unsigned char* out, size_t* bits) {
-  //Length may be zero.
-  unsigned pos = (*bits) >> 3;
-  unsigned char bitties = ((*bits) & 7);
-  *(unsigned*)(&(out[pos])) |= (symbol << bitties);
-  (*bits) += length;
-
-#else
-  for (unsigned i = 0; i < length; i++) {
-    unsigned bit = (symbol >> i) & 1;
-    if (*bp == 0) {(*outsize)++;}
-    out[*outsize - 1] |= bit << *bp;
-    *bp = (*bp + 1) & 7;
+/* Adds the lowest length bits of value. length can be up to 32, higher bits of value must be 0. */
+static inline void WriteBits(BitWriter* w, unsigned value, unsigned length) {
+  w->buf |= (unsigned long long)value << w->count;
+  w->count += length;
+  if (w->count >= 32) {
+    unsigned char* p = &w->out[w->pos];
+    p[0] = (unsigned char)w->buf;
+    p[1] = (unsigned char)(w->buf >> 8);
+    p[2] = (unsigned char)(w->buf >> 16);
+    p[3] = (unsigned char)(w->buf >> 24);
+    w->pos += 4;
+    w->buf >>= 32;
+    w->count -= 32;
   }
-#endif
 }
 
-/*
-Adds bits, like AddBits, but the order is inverted. The deflate specification
-uses both orders in one standard.
-*/
-static void AddHuffmanBits(unsigned symbol, unsigned length,
-                           unsigned char* bp, unsigned char* out,
-                           size_t* outsize) {
-  for (unsigned i = 0; i < length; i++) {
-    unsigned bit = (symbol >> (length - i - 1)) & 1;
-    if (*bp == 0) {(*outsize)++;}
-    out[*outsize - 1] |= bit << *bp;
-    *bp = (*bp + 1) & 7;
+/* Stores the remaining bits and updates bp and outsize. */
+static void BitWriterFinish(BitWriter* w, unsigned char* bp, size_t* outsize) {
+  for (unsigned i = 0; i < w->count; i += 8) {
+    w->out[w->pos++] = (unsigned char)(w->buf >> i);
   }
+  *bp = w->count & 7;
+  *outsize = w->pos;
 }
 
 /*
@@ -128,6 +124,7 @@ static void PatchDistanceCodesForBuggyDecoders(unsigned* d_lengths) {
 
 /*
  Converts a series of Huffman tree bitlengths to the bit values of the symbols.
+ The values are bit reversed, ready to be written LSB first by WriteBits.
  */
 static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned maxbits,
                             unsigned* symbols) {
@@ -156,8 +153,13 @@ static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned m
   for (i = 0;  i < n; i++) {
     unsigned len = lengths[i];
     if (len) {
-      symbols[i] = next_code[len];
-      next_code[len]++;
+      unsigned code = next_code[len]++;
+      unsigned reversed = 0;
+      for (unsigned j = 0; j < len; j++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+      }
+      symbols[i] = reversed;
     }
   }
 
@@ -166,19 +168,16 @@ static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned m
 }
 
 /*
-Encodes the Huffman tree and returns how many bits its encoding takes. If out
-is a null pointer, only returns the size and runs faster.
+Encodes the Huffman tree and returns how many bits its encoding takes.
 */
 static size_t EncodeTree(const unsigned* ll_lengths,
                          const unsigned* d_lengths,
                          int use_16, int use_17, int use_18, int fuse_8, int fuse_7,
-                         unsigned char* bp,
-                         unsigned char* out, size_t* outsize) {
+                         BitWriter* w) {
   /* Runlength encoded version of lengths of litlen and dist trees. */
-  unsigned* rle = 0;
-  unsigned* rle_bits = 0;  /* Extra bits for rle values 16, 17 and 18. */
+  unsigned char rle[288 + 32];
+  unsigned char rle_bits[288 + 32];  /* Extra bits for rle values 16, 17 and 18. */
   size_t rle_size = 0;  /* Size of rle array. */
-  size_t rle_bits_size = 0;  /* Should have same value as rle_size. */
   unsigned hlit = 29;  /* 286 - 257 */
   unsigned hdist = 29;  /* 32 - 1, but gzip does not like hdist > 29.*/
   size_t i, j;
@@ -188,7 +187,6 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   static const unsigned order[19] = {
     16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
   };
-  int size_only = !out;
 
   /* Trim zeros. */
   while (hlit && ll_lengths[257 + hlit - 1] == 0) hlit--;
@@ -214,10 +212,8 @@ static size_t EncodeTree(const unsigned* ll_lengths,
       if (use_18) {
         while (count >= 11) {
           unsigned count2 = count > 138 ? 138 : count;
-          if (!size_only) {
-            ZOPFLI_APPEND_DATA(18, &rle, &rle_size);
-            ZOPFLI_APPEND_DATA(count2 - 11, &rle_bits, &rle_bits_size);
-          }
+          rle[rle_size] = 18;
+          rle_bits[rle_size++] = count2 - 11;
           clcounts[18]++;
           count -= count2;
         }
@@ -225,10 +221,8 @@ static size_t EncodeTree(const unsigned* ll_lengths,
       if (use_17) {
         while (count >= 3) {
           unsigned count2 = count > 10 ? 10 : count;
-          if (!size_only) {
-            ZOPFLI_APPEND_DATA(17, &rle, &rle_size);
-            ZOPFLI_APPEND_DATA(count2 - 3, &rle_bits, &rle_bits_size);
-          }
+          rle[rle_size] = 17;
+          rle_bits[rle_size++] = count2 - 3;
           clcounts[17]++;
           count -= count2;
         }
@@ -239,35 +233,27 @@ static size_t EncodeTree(const unsigned* ll_lengths,
     if (use_16 && count >= 4) {
       count--;  /* Since the first one is hardcoded. */
       clcounts[symbol]++;
-      if (!size_only) {
-        ZOPFLI_APPEND_DATA(symbol, &rle, &rle_size);
-        ZOPFLI_APPEND_DATA(0, &rle_bits, &rle_bits_size);
-      }
+      rle[rle_size] = symbol;
+      rle_bits[rle_size++] = 0;
       while (count >= 3) {
         if (fuse_8 && count == 8) { /* record 8 as 4+4 not as 6+single+single */
-            if (!size_only) {
-                ZOPFLI_APPEND_DATA(16, &rle, &rle_size);
-                ZOPFLI_APPEND_DATA(1, &rle_bits, &rle_bits_size);
-                ZOPFLI_APPEND_DATA(16, &rle, &rle_size);
-                ZOPFLI_APPEND_DATA(1, &rle_bits, &rle_bits_size);
-            }
+            rle[rle_size] = 16;
+            rle_bits[rle_size++] = 1;
+            rle[rle_size] = 16;
+            rle_bits[rle_size++] = 1;
             clcounts[16] += 2;
             count = 0;
         } else if (fuse_7 && count == 7) { /* record 7 as 4+3 not as 6+single */
-            if (!size_only) {
-                ZOPFLI_APPEND_DATA(16, &rle, &rle_size);
-                ZOPFLI_APPEND_DATA(1, &rle_bits, &rle_bits_size);
-                ZOPFLI_APPEND_DATA(16, &rle, &rle_size);
-                ZOPFLI_APPEND_DATA(0, &rle_bits, &rle_bits_size);
-            }
+            rle[rle_size] = 16;
+            rle_bits[rle_size++] = 1;
+            rle[rle_size] = 16;
+            rle_bits[rle_size++] = 0;
             clcounts[16] += 2;
             count = 0;
         } else {
             unsigned count2 = count > 6 ? 6 : count;
-            if (!size_only) {
-                ZOPFLI_APPEND_DATA(16, &rle, &rle_size);
-                ZOPFLI_APPEND_DATA(count2 - 3, &rle_bits, &rle_bits_size);
-            }
+            rle[rle_size] = 16;
+            rle_bits[rle_size++] = count2 - 3;
             clcounts[16]++;
             count -= count2;
         }
@@ -276,12 +262,10 @@ static size_t EncodeTree(const unsigned* ll_lengths,
 
     /* No or insufficient repetition */
     clcounts[symbol] += count;
-    if (!size_only) {
-      while (count) {
-        ZOPFLI_APPEND_DATA(symbol, &rle, &rle_size);
-        ZOPFLI_APPEND_DATA(0, &rle_bits, &rle_bits_size);
-        count--;
-      }
+    while (count) {
+      rle[rle_size] = symbol;
+      rle_bits[rle_size++] = 0;
+      count--;
     }
   }
   ZopfliLengthLimitedCodeLengths(clcounts, 19, 7, clcl);
@@ -291,69 +275,185 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   while (hclen && clcounts[order[hclen + 4 - 1]] == 0) hclen--;
 
   //It would be possible to check if the rle code use is actually profitable, but the current implementation is good enough that this approach would only yield a single saved byte on enwik8.
-  if (!size_only) {
-    unsigned clsymbols[19];
-    ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
+  unsigned clsymbols[19];
+  ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
 
-    AddBits(hlit, 5, bp, out, outsize);
-    AddBits(hdist, 5, bp, out, outsize);
-    AddBits(hclen, 4, bp, out, outsize);
+  WriteBits(w, hlit, 5);
+  WriteBits(w, hdist, 5);
+  WriteBits(w, hclen, 4);
 
-    for (i = 0; i < hclen + 4; i++) {
-      AddBits(clcl[order[i]], 3, bp, out, outsize);
-    }
+  for (i = 0; i < hclen + 4; i++) {
+    WriteBits(w, clcl[order[i]], 3);
+  }
+
+  size_t result_size = 14 + (hclen + 4) * 3;  /* hlit, hdist, hclen bits and clcl bits */
+  for (i = 0; i < rle_size; i++) {
+    /* Extra bits. */
+    static const unsigned char extra[3] = {2, 3, 7};
+    unsigned bits = rle[i] >= 16 ? extra[rle[i] - 16] : 0;
+    WriteBits(w, clsymbols[rle[i]] | (rle_bits[i] << clcl[rle[i]]), clcl[rle[i]] + bits);
+    result_size += clcl[rle[i]] + bits;
+  }
 
-    for (i = 0; i < rle_size; i++) {
-      unsigned symbol = clsymbols[rle[i]];
-      AddHuffmanBits(symbol, clcl[rle[i]], bp, out, outsize);
-      /* Extra bits. */
-      if (rle[i] == 16) AddBits(rle_bits[i], 2, bp, out, outsize);
-      else if (rle[i] == 17) AddBits(rle_bits[i], 3, bp, out, outsize);
-      else if (rle[i] == 18) AddBits(rle_bits[i], 7, bp, out, outsize);
+  return result_size;
+}
+
+/*
+Counts the code length codes of the tree encoding for the requested variants of
+EncodeTree in a single pass over the runs of code lengths. Variant i uses
+use_16 = i & 1, use_17 = i & 2, use_18 = i & 4, fuse_8 = i & 8 and
+fuse_7 = i & 16, like the loop in CalculateTreeSize. Zeros are trimmed like in
+EncodeTree.
+*/
+static void CountTreeSymbols(const unsigned* ll_lengths, const unsigned* d_lengths,
+                             unsigned variants, size_t clcounts[32][19]) {
+  unsigned hlit = 29;
+  unsigned hdist = 29;
+  while (hlit && ll_lengths[257 + hlit - 1] == 0) hlit--;
+  while (hdist && d_lengths[hdist] == 0) hdist--;
+  unsigned hlit2 = hlit + 257;
+  unsigned lld_total = hlit2 + hdist + 1;
+
+  for (unsigned v = 0; v < 32; v++) {
+    if (variants & (1u << v)) {
+      for (unsigned k = 0; k < 19; k++) clcounts[v][k] = 0;
     }
+  }
 
-    free(rle);
-    free(rle_bits);
+  for (unsigned i = 0; i < lld_total;) {
+    unsigned symbol = i < hlit2 ? ll_lengths[i] : d_lengths[i - hlit2];
+    unsigned run = 1;
+    while (i + run < lld_total && symbol == (i + run < hlit2 ? ll_lengths[i + run] : d_lengths[i + run - hlit2])) {
+      run++;
+    }
+    i += run;
+
+    for (unsigned v = 0; v < 32; v++) {
+      if (!(variants & (1u << v))) continue;
+      size_t* c = clcounts[v];
+      int use_16 = v & 1, use_17 = v & 2, use_18 = v & 4, fuse_8 = v & 8, fuse_7 = v & 16;
+      unsigned count = run;
+      if (!(use_16 || (symbol == 0 && (use_17 || use_18)))) {
+        c[symbol] += count;
+        continue;
+      }
+      if (symbol == 0 && count >= 3) {
+        if (use_18) {
+          while (count >= 11) {
+            c[18]++;
+            count -= count > 138 ? 138 : count;
+          }
+        }
+        if (use_17) {
+          while (count >= 3) {
+            c[17]++;
+            count -= count > 10 ? 10 : count;
+          }
+        }
+      }
+      if (use_16 && count >= 4) {
+        count--;
+        c[symbol]++;
+        while (count >= 3) {
+          if ((fuse_8 && count == 8) || (fuse_7 && count == 7)) {
+            c[16] += 2;
+            count = 0;
+          } else {
+            c[16]++;
+            count -= count > 6 ? 6 : count;
+          }
+        }
+      }
+      c[symbol] += count;
+    }
   }
+}
+
+/* Size in bits of a tree encoding with the given code length code counts. */
+static size_t TreeSizeFromCounts(const size_t* clcounts) {
+  static const unsigned order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  unsigned clcl[19];
+  ZopfliLengthLimitedCodeLengths(clcounts, 19, 7, clcl);
+
+  unsigned hclen = 15;
+  while (hclen && clcounts[order[hclen + 4 - 1]] == 0) hclen--;
 
-  size_t result_size = 14;  /* hlit, hdist, hclen bits */
-  result_size += (hclen + 4) * 3;  /* clcl bits */
-  for(i = 0; i < 19; i++) {
+  size_t result_size = 14 + (hclen + 4) * 3;
+  for (unsigned i = 0; i < 19; i++) {
     result_size += clcl[i] * clcounts[i];
   }
-  /* Extra bits. */
   result_size += clcounts[16] * 2;
   result_size += clcounts[17] * 3;
   result_size += clcounts[18] * 7;
-
   return result_size;
 }
 
+/*
+Results of recent CalculateTreeSize calls, kept per thread in a direct mapped
+table. The same code lengths are sized again by AddLZ77Block, ReplaceBadCodes
+rounds and the block size estimates.
+*/
+typedef struct CachedTreeSize {
+  unsigned long long hash;  /* 0 if unused. */
+  unsigned char lengths[288 + 32];
+  unsigned char hq;
+  unsigned char best;
+  size_t size;
+} CachedTreeSize;
+
+static thread_local CachedTreeSize treecache[64];
+
 /*
 Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
 */
 size_t CalculateTreeSize(const unsigned* ll_lengths,
                                 unsigned* d_lengths, unsigned char hq, unsigned* best) {
   PatchDistanceCodesForBuggyDecoders(d_lengths);
+
+  unsigned char lengths[288 + 32];
+  unsigned long long hash = hq + 1;
+  for (unsigned i = 0; i < 288 + 32; i++) {
+    lengths[i] = i < 288 ? ll_lengths[i] : d_lengths[i - 288];
+    hash = (hash ^ lengths[i]) * 0x100000001B3ULL;
+  }
+  hash |= 1;
+  CachedTreeSize* entry = &treecache[(hash >> 32) & 63];
+  if (entry->hash == hash && entry->hq == hq && !memcmp(entry->lengths, lengths, sizeof(lengths))) {
+    *best = entry->best;
+    return entry->size;
+  }
+
+  size_t clcounts[32][19];
   size_t result = 0;
   if (hq){
+    /* With hq == 1, variant 9 also fuses 7, so it is counted as variant 25. */
+    unsigned variants = hq == 2 ? 0xFFFFFFFFu : 0x020001FFu;
+    CountTreeSymbols(ll_lengths, d_lengths, variants, clcounts);
     for(unsigned i = 0; i < (hq == 2 ? 32 : 10); i++) {
       if (!(i & 1) && (i & 8 || i & 16)){
         continue;
       }
-      size_t size = EncodeTree(ll_lengths, d_lengths,
-                               i & 1, i & 2, i & 4, i & 8, i & 16 || (hq == 1 && i == 9),
-                               0, 0, 0);
+      size_t size = TreeSizeFromCounts(clcounts[hq == 1 && i == 9 ? 25 : i]);
       if (result == 0 || size < result){
         result = size;
         *best = i;
       }
     }
-
-    return result;
   }
-  *best = 7;
-  return EncodeTree(ll_lengths, d_lengths, 1, 1, 1, 0, 0, 0, 0, 0);
+  else{
+    CountTreeSymbols(ll_lengths, d_lengths, 1u << 7, clcounts);
+    result = TreeSizeFromCounts(clcounts[7]);
+    *best = 7;
+  }
+
+  entry->hash = hash;
+  entry->hq = hq;
+  memcpy(entry->lengths, lengths, sizeof(lengths));
+  entry->best = *best;
+  entry->size = result;
+  return result;
 }
 
 /*
@@ -361,111 +461,52 @@ Adds all lit/len and dist codes from the lists as huffman symbols. Does not add
 end code 256. expected_data_size is the uncompressed block size, used for
 assert, but you can set it to 0 to not do the assertion.
 */
-//TODO: Rewrite for x86_64 where bitbuffer is refilled once per len/dist pair
 static void AddLZ77Data(const unsigned short* litlens,
                         const unsigned short* dists,
                         size_t lstart, size_t lend,
                         size_t expected_data_size,
-                        unsigned* ll_symbols, const unsigned* ll_lengths,
-                        unsigned* d_symbols, const unsigned* d_lengths,
-                        unsigned char* bp,
-                        unsigned char* out, size_t* outsize) {
+                        const unsigned* ll_symbols, const unsigned* ll_lengths,
+                        const unsigned* d_symbols, const unsigned* d_lengths,
+                        BitWriter* w) {
   size_t testlength = 0;
   size_t i;
-  //Revert some codes so we can choose the fast AddBits() function
-#if defined(__i386__) || defined(_M_IX86) || defined(__x86_64__) || defined(_M_X64)
-
-  for (i = 0; i < 30; i++){
-    for (unsigned j = 0; j < d_lengths[i] / 2; j++){
-      unsigned bit = d_symbols[i] & (1 << j);
-      unsigned bit2 = d_symbols[i] & (1 << (d_lengths[i] - j - 1));
-      d_symbols[i] &= UINT_MAX - (1 << j) - (1 << (d_lengths[i] - j - 1));
-      d_symbols[i] |= (!!bit) << (d_lengths[i] - j - 1);
-      d_symbols[i] |= (!!bit2) << j;
-    }
-  }
-  for (i = 0; i < 286; i++){
-    for (unsigned j = 0; j < ll_lengths[i] / 2; j++){
-      unsigned bit = ll_symbols[i] & (1 << j);
-      unsigned bit2 = ll_symbols[i] & (1 << (ll_lengths[i] - j - 1));
-      ll_symbols[i] &= UINT_MAX - (1 << j) - (1 << (ll_lengths[i] - j - 1));
-      ll_symbols[i] |= (!!bit) << (ll_lengths[i] - j - 1);
-      ll_symbols[i] |= (!!bit2) << j;
-    }
-  }
+  /* Length codes with their extra bits appended, at most 20 bits. */
   unsigned len_symbols[259];
   unsigned len_lengths[259];
   for (i = 3; i < 259; i++){
-    unsigned lls = ZopfliGetLengthSymbol(i);
-    if(ll_lengths[lls]){
-      unsigned bitlen = ll_lengths[lls];
-      len_lengths[i] = bitlen + ZopfliGetLengthExtraBits(i);
-      assert(len_lengths[i] <= 25);
-      len_symbols[i] = ll_symbols[lls] + (ZopfliGetLengthExtraBitsValue(i) << bitlen);
+    const ZopfliLengthCode* lc = &ZopfliLengthCodes[i];
+    if(ll_lengths[lc->symbol]){
+      unsigned bitlen = ll_lengths[lc->symbol];
+      len_lengths[i] = bitlen + lc->bits;
+      assert(len_lengths[i] <= 20);
+      len_symbols[i] = ll_symbols[lc->symbol] + (lc->value << bitlen);
     }
   }
 
-  size_t bits = (*outsize) * 8 + *bp - ((*bp) != 0) * 8;
-
-#define setbits AddBits
-#define FAST_BITWRITER
-#else
-#define setbits AddHuffmanBits
-#endif
-
   for (i = lstart; i < lend; i++) {
     unsigned dist = dists[i];
     unsigned litlen = litlens[i];
     if (dist == 0) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
-#ifdef FAST_BITWRITER
-      AddBits2(ll_symbols[litlen], ll_lengths[litlen], out, &bits);
-#else 
-      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
-#endif
+      WriteBits(w, ll_symbols[litlen], ll_lengths[litlen]);
 
       testlength++;
     } else {
       assert(litlen >= 3 && litlen <= ZOPFLI_MAX_MATCH);
-      unsigned ds = ZopfliGetDistSymbol(dist);
+      const ZopfliDistCode* dc = ZopfliGetDistCode(dist);
+      unsigned ds = dc->symbol;
       assert(d_lengths[ds]);
 
-
-#ifdef FAST_BITWRITER
-      AddBits2(len_symbols[litlen],
-               len_lengths[litlen],
-               out, &bits);
-
-      AddBits2(d_symbols[ds], d_lengths[ds], out, &bits);
-
-      AddBits2(ZopfliGetDistExtraBitsValue(dist),
-               ZopfliGetDistExtraBits(dist),
-               out, &bits);
-#else
-      unsigned lls = ZopfliGetLengthSymbol(litlen);
-      assert(ll_lengths[lls]);
-
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
-      AddBits(ZopfliGetLengthExtraBitsValue(litlen),
-              ZopfliGetLengthExtraBits(litlen),
-              bp, out, outsize);
-
-      AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
-      AddBits(ZopfliGetDistExtraBitsValue(dist),
-              ZopfliGetDistExtraBits(dist),
-              bp, out, outsize);
-#endif
+      WriteBits(w, len_symbols[litlen], len_lengths[litlen]);
+      /* Dist code and extra bits together are at most 28 bits. */
+      WriteBits(w, d_symbols[ds] | (((dist - 1) & ((1u << dc->bits) - 1)) << d_lengths[ds]),
+                d_lengths[ds] + dc->bits);
 
       testlength += litlen;
     }
   }
 
-#ifdef FAST_BITWRITER
-  *bp = bits & 7;
-  (*outsize) = (bits / 8) + ((bits & 7) != 0);
-#endif
-
   assert(testlength == expected_data_size);
 }
 
@@ -883,13 +924,114 @@ double ZopfliCalculateBlockSize(const unsigned short* litlens,
   return result;
 }
 
-static unsigned char ReplaceBadCodes(unsigned short** litlens,
-                            unsigned short** dists,
-                            size_t* lend, const unsigned char* in, size_t instart, unsigned* ll_lengths, unsigned* d_lengths){
-  size_t end = *lend;
+/*
+Matches of length 3 to 7 that ReplaceBadCodes may turn back into literals. Only
+these are visited in each round, the symbol counts are updated by delta.
+*/
+typedef struct BadCodes {
+  size_t* index;  /* Positions of the candidates in the LZ77 data. */
+  size_t* pos;  /* Positions of the candidates in the input. */
+  size_t size;  /* Amount of candidates still encoded as matches. */
+  unsigned char* replaced;  /* Per LZ77 symbol, 1 if replaced by literals. */
+  size_t added;  /* Amount of LZ77 symbols added by the replacements. */
+} BadCodes;
+
+static void InitBadCodes(BadCodes* bc, const unsigned short* litlens, const unsigned short* dists,
+                         size_t lend, size_t instart) {
+  bc->size = 0;
+  bc->added = 0;
+  for (size_t i = 0; i < lend; i++) {
+    if (dists[i] && litlens[i] <= 7){
+      bc->size++;
+    }
+  }
+  bc->index = (size_t*)malloc(bc->size * sizeof(size_t) + 1);
+  bc->pos = (size_t*)malloc(bc->size * sizeof(size_t) + 1);
+  bc->replaced = (unsigned char*)calloc(lend + 1, 1);
+  if (!(bc->index && bc->pos && bc->replaced)){
+    exit(1);
+  }
+  size_t pos = instart;
+  size_t k = 0;
+  for (size_t i = 0; i < lend; i++) {
+    if (dists[i] && litlens[i] <= 7){
+      bc->index[k] = i;
+      bc->pos[k++] = pos;
+    }
+    pos += dists[i] == 0 ? 1 : litlens[i];
+  }
+}
+
+static void CleanBadCodes(BadCodes* bc) {
+  free(bc->index);
+  free(bc->pos);
+  free(bc->replaced);
+}
+
+/*
+Replaces the candidate matches that are more expensive than the literals they
+cover with the current code lengths, and updates the symbol counts. Returns
+whether any match was replaced.
+*/
+static unsigned char ReplaceBadCodes(BadCodes* bc, const unsigned short* litlens,
+                            const unsigned short* dists, const unsigned char* in,
+                            size_t* ll_counts, size_t* d_counts,
+                            const unsigned* ll_lengths, const unsigned* d_lengths){
+  size_t kept = 0;
+  for (size_t k = 0; k < bc->size; k++){
+    size_t i = bc->index[k];
+    size_t pos = bc->pos[k];
+    unsigned dist = dists[i];
+    unsigned length = litlens[i];
+    unsigned char change = 0;
 
-  unsigned short* litlens2 = (unsigned short*)malloc(end * 3 * sizeof(unsigned short));
-  unsigned short* dists2 = (unsigned short*)malloc(end * 3 * sizeof(unsigned short));
+    /*Check if the match is cheaper than several literals*/
+    const unsigned char* litplace = &in[pos - dist];
+    unsigned litprice = 0;
+    unsigned char cont = 1;
+    for(unsigned j = 0; j < length; j++){
+      if (!ll_lengths[litplace[j]]){
+        //Bail out.
+        cont = 0;
+        break;
+      }
+      litprice += ll_lengths[litplace[j]];
+    }
+    if (cont){
+      const ZopfliLengthCode* lc = &ZopfliLengthCodes[length];
+      const ZopfliDistCode* dc = ZopfliGetDistCode(dist);
+      unsigned char distprice = ll_lengths[lc->symbol] + lc->bits + dc->bits + d_lengths[dc->symbol];
+      if (litprice < distprice){
+        change = 1;
+        ll_counts[lc->symbol]--;
+        d_counts[dc->symbol]--;
+        for(unsigned j = 0; j < length; j++){
+          ll_counts[litplace[j]]++;
+        }
+        bc->replaced[i] = 1;
+        bc->added += length - 1;
+      }
+    }
+    if (!change){
+      bc->index[kept] = i;
+      bc->pos[kept++] = pos;
+    }
+  }
+  unsigned char result = kept != bc->size;
+  bc->size = kept;
+  return result;
+}
+
+/*
+Rewrites the LZ77 data with the replaced matches as literals. The old arrays are
+freed.
+*/
+static void ApplyBadCodes(const BadCodes* bc, unsigned short** litlens,
+                          unsigned short** dists, size_t* lend,
+                          const unsigned char* in, size_t instart){
+  size_t end = *lend;
+  unsigned short* litlens2 = (unsigned short*)malloc((end + bc->added) * sizeof(unsigned short) + 1);
+  unsigned short* dists2 = (unsigned short*)malloc((end + bc->added) * sizeof(unsigned short) + 1);
   if (!(litlens2 && dists2)){
     exit(1);
   }
@@ -897,48 +1039,26 @@ static unsigned char ReplaceBadCodes(unsigned short** litlens,
   size_t pos = instart;
   size_t k = 0;
   for (size_t i = 0; i < end; i++){
-    unsigned char change = 0;
     size_t length = (*dists)[i] == 0 ? 1 : (*litlens)[i];
-    if (length >= 3 && length <= 7){
-      /*Check if the match is cheaper than several literals*/
+    if (bc->replaced[i]){
       const unsigned char* litplace = &in[pos - (*dists)[i]];
-      unsigned litprice = 0;
-      unsigned char cont = 1;
       for(unsigned j = 0; j < length; j++){
-        if (!ll_lengths[*litplace]){
-          //Bail out.
-          cont = 0;
-          break;
-        }
-        litprice += ll_lengths[*litplace++];
-      }
-      if (cont){
-        unsigned char distprice = ll_lengths[ZopfliGetLengthSymbol(length)] + ZopfliGetLengthExtraBits(length) + ZopfliGetDistExtraBits((*dists)[i])
-          + d_lengths[ZopfliGetDistSymbol((*dists)[i])];
-        if (litprice < distprice){
-          litplace = &in[pos - (*dists)[i]];
-          change = 1;
-          for(unsigned j = 0; j < length; j++){
-            litlens2[i + k] = *litplace;
-            dists2[i + k] = 0;
-            k++;
-            litplace++;
-          }
-          k--;
-          (*lend) += length - 1;
-        }
+        litlens2[k] = litplace[j];
+        dists2[k++] = 0;
       }
     }
-    if (!change){
-      litlens2[i + k] = (*litlens)[i];
-      dists2[i + k] = (*dists)[i];
+    else{
+      litlens2[k] = (*litlens)[i];
+      dists2[k++] = (*dists)[i];
     }
     pos += length;
   }
 
+  free(*litlens);
+  free(*dists);
   (*litlens) = litlens2;
   (*dists) = dists2;
-  return end != *lend;
+  (*lend) = k;
 }
 
 /*
@@ -985,33 +1105,39 @@ static void AddLZ77Block(int btype, int final,
     outpred = ZopfliCalculateBlockSize(litlens, dists, 0, lend, 1, 0, 0);
   } else{
     /* Dynamic block. */
+    size_t ll_counts[288];
+    size_t d_counts[32];
+    ZopfliLZ77Counts(litlens, dists, 0, lend, ll_counts, d_counts, 0);
     outpred = 3;
-    outpred += GetDynamicLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
+    outpred += GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
     outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
 
-    unsigned char change = 1;
-    for (unsigned i = 0; i < replaceCodes; i++){
-      if (!(i & 1)){
-        unsigned short * free1 = litlens;
-        unsigned short * free2 = dists;
-        change = ReplaceBadCodes(&litlens, &dists, &lend, in, instart, ll_lengths, d_lengths);
-        if (!change && i + 1 != replaceCodes && i){
-          outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
+    if (replaceCodes){
+      BadCodes bc;
+      InitBadCodes(&bc, litlens, dists, lend, instart);
+      for (unsigned i = 0; i < replaceCodes; i++){
+        if (!(i & 1)){
+          unsigned char change = ReplaceBadCodes(&bc, litlens, dists, in, ll_counts, d_counts, ll_lengths, d_lengths);
+          if (!change && i + 1 != replaceCodes && i){
+            outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
+          }
+          if (!change){
+            break;
+          }
         }
-        free(free1);
-        free(free2);
-        if (!change){
-          break;
+        else{
+          //TODO: This may make compression worse due to bigger huffman headers.
+          outpred = 3;
+          outpred += GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
+          if (replaceCodes - i < 3 || advanced){
+            outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
+          }
         }
       }
-      else{
-        //TODO: This may make compression worse due to bigger huffman headers.
-        outpred = 3;
-        outpred += GetDynamicLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
-        if (replaceCodes - i < 3 || advanced){
-          outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
-        }
+      if (bc.added){
+        ApplyBadCodes(&bc, &litlens, &dists, &lend, in, instart);
       }
+      CleanBadCodes(&bc);
     }
   }
   outpred += *outsize * 8 + *bp -((*bp != 0) * 8);
@@ -1021,28 +1147,29 @@ static void AddLZ77Block(int btype, int final,
   }
   memset(&((*out)[*outsize]), 0, outpred / 8 + (!!(outpred & 7)) - (*outsize) + 8);
 
-  AddBit(final, bp, out, outsize);
-  AddBit(btype & 1, bp, out, outsize);
-  AddBit((btype & 2) >> 1, bp, out, outsize);
+  size_t startbits = *outsize * 8 + *bp - ((*bp != 0) * 8);
+  BitWriter w;
+  BitWriterInit(&w, *out, *outsize, *bp);
+  WriteBits(&w, final | (btype << 1), 3);
 
   if (btype == 2){
     if(advanced){
-      outpred = *outsize * 8 + *bp -((*bp != 0) * 8) + GetAdvancedLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
+      outpred = startbits + 3 + GetAdvancedLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
       outpred += CalculateTreeSize(ll_lengths, d_lengths, 2, &best);
     }
     PatchDistanceCodesForBuggyDecoders(d_lengths);
     EncodeTree(ll_lengths, d_lengths,
                best & 1, best & 2, best & 4, best & 8 , best & 16 || (hq == 1 && best == 9 && !advanced),
-               bp, *out, outsize);
+               &w);
   }
   ZopfliLengthsToSymbols(ll_lengths, 288, 15, ll_symbols);
   ZopfliLengthsToSymbols(d_lengths, 32, 15, d_symbols);
   AddLZ77Data(litlens, dists, 0, lend
               , expected_data_size
               , ll_symbols, ll_lengths, d_symbols, d_lengths,
-              bp, *out, outsize);
-  setbits(ll_symbols[256], ll_lengths[256], bp, *out, outsize);
-#undef setbits
+              &w);
+  WriteBits(&w, ll_symbols[256], ll_lengths[256]);
+  BitWriterFinish(&w, bp, outsize);
 
   if (!(replaceCodes & 1)){
     assert(outpred == *outsize * 8 + *bp - (*bp != 0) * 8);
@@ -1053,11 +1180,25 @@ static void AddLZ77Block(int btype, int final,
   }
 }
 
+/*
+Sets prev[i] to the block whose cost model block i starts from: the block before
+it if both are in the same master block, npoints + 1 otherwise.
+*/
+static void LinkBlocks(size_t instart, const size_t* splitpoints, size_t npoints,
+                       size_t msize, size_t* prev) {
+  prev[0] = npoints + 1;
+  for (size_t i = 1; i <= npoints; i++) {
+    prev[i] = (splitpoints[i - 1] - instart) % msize ? i - 1 : npoints + 1;
+  }
+}
+
 static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
                                 const unsigned char* in,
                                 size_t instart, size_t inend,
                                 unsigned char* bp,
-                                unsigned char** out, size_t* outsize, unsigned char* costmodelnotinited, SymbolStats* statsp, unsigned char twiceMode, ZopfliLZ77Store* twiceStore, unsigned mfinexport) {
+                                unsigned char** out, size_t* outsize, const SymbolStats* statsp,
+                                ZopfliCostModel* prev, ZopfliCostModel* self,
+                                unsigned char twiceMode, ZopfliLZ77Store* twiceStore, unsigned mfinexport) {
   size_t blocksize = inend - instart;
   ZopfliLZ77Store store;
   int btype = 2;
@@ -1067,11 +1208,13 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
   if (blocksize <= options->skipdynamic){
     btype = 1;
     ZopfliLZ77OptimalFixed(options, in, instart, inend, &store, mfinexport);
+    if (self){
+      ZopfliPublishCostModel(self, 0);
+    }
   }
   else{
-    ZopfliLZ77Optimal2(options, in, instart, inend, &store, *costmodelnotinited, statsp, mfinexport);
+    ZopfliLZ77Optimal2(options, in, instart, inend, &store, statsp, prev, self, mfinexport);
   }
-  *costmodelnotinited = 0;
 
   /* For small block, encoding with fixed tree can be smaller. For large block,
   don't bother doing this expensive test, dynamic tree will be better.*/
@@ -1107,26 +1250,176 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
   }
 }
 
+/*
+Compresses in[instart, inend) with lazy matching instead of the optimal parser.
+The LZ77 data is split into blocks, each block uses whichever of the dynamic and
+fixed tree is smaller.
+*/
+static void DeflateFast(const ZopfliOptions* options, int final,
+                        const unsigned char* in, size_t instart, size_t inend,
+                        unsigned char* bp, unsigned char** out, size_t* outsize) {
+  ZopfliLZ77Store store;
+  ZopfliInitLZ77Store(&store);
+  ZopfliLZ77Lazy(options, in, instart, inend, &store, 0);
+
+  size_t npoints = 0;
+  size_t* splitpoints = 0;
+  if (inend - instart >= options->noblocksplit){
+    ZopfliBlockSplitLZ77(store.litlens, store.dists, store.size, &splitpoints, &npoints, options, 0);
+  }
+
+  size_t pos = instart;
+  for (size_t i = 0; i <= npoints; i++) {
+    size_t start = i == 0 ? 0 : splitpoints[i - 1];
+    size_t end = i == npoints ? store.size : splitpoints[i];
+    double dyncost = ZopfliCalculateBlockSize(store.litlens, store.dists, start, end, 2, options->searchext, 0);
+    double fixedcost = ZopfliCalculateBlockSize(store.litlens, store.dists, start, end, 1, 0, 0);
+    size_t blocksize = 0;
+    for (size_t j = start; j < end; j++) {
+      blocksize += store.dists[j] ? store.litlens[j] : 1;
+    }
+    AddLZ77Block(fixedcost <= dyncost ? 1 : 2, final && i == npoints,
+                 store.litlens + start, store.dists + start, end - start,
+                 blocksize, bp, out, outsize, options->searchext, in, pos, 0, 0);
+    pos += blocksize;
+  }
+  free(splitpoints);
+  ZopfliCleanLZ77Store(&store);
+}
+
+size_t ZopfliMasterBlockSize(const ZopfliOptions* options) {
+  size_t msize = ZOPFLI_MASTER_BLOCK_SIZE;
+  if (!options->isPNG && options->numiterations == 1){
+    msize /= 5;
+  }
+  return msize;
+}
+
+/*
+Cheap check whether compressing in[instart, inend) is worth it. A greedy pass
+with a hash of 4 bytes finds matches, the remaining literals are costed by their
+order-0 entropy and every match at 24 bits. Returns 1 if the predicted gain is
+below options->storethreshold permille.
+*/
+static int IsIncompressible(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend) {
+  if (!options->storethreshold || inend - instart < 16384){
+    return 0;
+  }
+  unsigned* head = (unsigned*)calloc(65536, sizeof(unsigned));
+  if (!head){
+    exit(1);
+  }
+  size_t counts[256] = {0};
+  size_t matches = 0;
+  size_t i = instart;
+  while (i + 4 <= inend) {
+    unsigned v = in[i] | (in[i + 1] << 8) | (in[i + 2] << 16) | ((unsigned)in[i + 3] << 24);
+    unsigned h = (v * 2654435761U) >> 16;
+    size_t prev = head[h];
+    head[h] = i - instart + 1;
+    if (prev && i - instart + 1 - prev <= ZOPFLI_WINDOW_SIZE && !memcmp(&in[instart + prev - 1], &in[i], 4)) {
+      const unsigned char* match = &in[instart + prev - 1];
+      size_t limit = inend - i < ZOPFLI_MAX_MATCH ? inend - i : ZOPFLI_MAX_MATCH;
+      size_t length = 4;
+      while (length < limit && match[length] == in[i + length]) {
+        length++;
+      }
+      matches++;
+      i += length;
+    }
+    else {
+      counts[in[i++]]++;
+    }
+  }
+  for (; i < inend; i++) {
+    counts[in[i]]++;
+  }
+  free(head);
+
+  size_t literals = 0;
+  for (i = 0; i < 256; i++) {
+    literals += counts[i];
+  }
+  double bits = matches * 24.0;
+  for (i = 0; i < 256; i++) {
+    if (counts[i]) {
+      bits += counts[i] * log2((double)literals / counts[i]);
+    }
+  }
+  double size = (inend - instart) * 8.0;
+  return (size - bits) * 1000 < size * options->storethreshold;
+}
+
+/* Adds in[instart, inend) as stored blocks. */
+static void AddStoredBlocks(int final, const unsigned char* in, size_t instart, size_t inend,
+                            unsigned char* bp, unsigned char** out, size_t* outsize) {
+  size_t blocks = (inend - instart + 65534) / 65535;
+  (*out) = (unsigned char*)realloc(*out, *outsize + inend - instart + blocks * 5 + 1);
+  if (!(*out)){
+    exit(1);
+  }
+  for (size_t i = instart; i < inend; i += 65535) {
+    size_t size = inend - i < 65535 ? inend - i : 65535;
+    BitWriter w;
+    BitWriterInit(&w, *out, *outsize, *bp);
+    WriteBits(&w, final && i + size == inend, 3);  // btype 00
+    BitWriterFinish(&w, bp, outsize);
+    *bp = 0;  // The rest of the byte is padding.
+    unsigned char* o = &(*out)[*outsize];
+    o[0] = size % 256;
+    o[1] = size / 256;
+    o[2] = ~o[0];
+    o[3] = ~o[1];
+    memcpy(o + 4, &in[i], size);
+    (*outsize) += size + 4;
+  }
+}
+
 #ifndef NOMULTI
+/*
+Returns the order to compress the npoints + 1 blocks in, by the size of the
+block and the blocks chained after it by prev, largest first. A chained block
+always comes after the block it waits for. prev may be NULL for no chains.
+*/
+static size_t* ScheduleBlocks(size_t instart, size_t inend, const size_t* splitpoints,
+                              size_t npoints, const size_t* prev) {
+  size_t numblocks = npoints + 1;
+  size_t* order = (size_t*)malloc(numblocks * sizeof(size_t));
+  size_t* work = (size_t*)malloc(numblocks * sizeof(size_t));
+  if (!order || !work) exit(1); /* Allocation failed. */
+  for (size_t i = numblocks; i-- > 0;) {
+    order[i] = i;
+    work[i] = (i == npoints ? inend : splitpoints[i]) - (i ? splitpoints[i - 1] : instart);
+    if (prev && i < npoints && prev[i + 1] == i) {
+      work[i] += work[i + 1];
+    }
+  }
+  std::sort(order, order + numblocks, [=](size_t a, size_t b) {
+    return work[a] != work[b] ? work[a] > work[b] : a < b;
+  });
+  free(work);
+  return order;
+}
+
 struct BlockData {
   int btype;
   ZopfliLZ77Store store;
   size_t start;
   size_t end;
   SymbolStats* statsp;
+  ZopfliCostModel* prev;
+  ZopfliCostModel* self;
 };
 
 static void DeflateDynamicBlock2(const ZopfliOptions* options, const unsigned char* in,
-                                 BlockData** instore, BlockData* blockend, std::mutex& mtx) {
+                                 BlockData* blocks, const size_t* order, size_t numblocks,
+                                 std::atomic<size_t>& next) {
   for(;;) {
-    mtx.lock();
-    BlockData* store = *instore;
-    if(store == blockend){
-      mtx.unlock();
+    size_t k = next++;
+    if(k >= numblocks){
       return;
     }
-    (*instore)++;
-    mtx.unlock();
+    BlockData* store = &blocks[order[k]];
     size_t instart = store->start;
     size_t inend = store->end;
     size_t blocksize = inend - instart;
@@ -1137,9 +1430,12 @@ static void DeflateDynamicBlock2(const ZopfliOptions* options, const unsigned ch
     if (blocksize <= options->skipdynamic){
       store->btype = 1;
       ZopfliLZ77OptimalFixed(options, in, instart, inend, &store->store, 0);
+      if (store->self){
+        ZopfliPublishCostModel(store->self, 0);
+      }
     }
     else{
-      ZopfliLZ77Optimal2(options, in, instart, inend, &store->store, 1, store->statsp, 0);
+      ZopfliLZ77Optimal2(options, in, instart, inend, &store->store, store->statsp, store->prev, store->self, 0);
     }
     
     /* For small block, encoding with fixed tree can be smaller. For large block,
@@ -1164,12 +1460,12 @@ static void DeflateDynamicBlock2(const ZopfliOptions* options, const unsigned ch
 
 static void DeflateSplittingFirst2(
   const ZopfliOptions* options, int final,
-  const unsigned char* in, size_t inend,
+  const unsigned char* in, size_t instart, size_t inend,
   unsigned char* bp, unsigned char** out, size_t* outsize,
   size_t npoints, size_t* splitpoints, SymbolStats* statsp,
- unsigned char twiceMode, ZopfliLZ77Store* twiceStore, size_t msize)
+ unsigned char twiceMode, ZopfliLZ77Segments* twiceStore, size_t msize)
 {
-  size_t mnext = msize;
+  size_t mnext = instart + msize;
   unsigned numblocks = npoints + 1;
 
   unsigned threads = options->multithreading;
@@ -1178,52 +1474,46 @@ static void DeflateSplittingFirst2(
   }
   std::vector<std::thread> multi (threads);
   std::vector<BlockData> d (numblocks);
+  ZopfliCostModel* models = ZopfliAllocCostModels(options, numblocks);
+  std::vector<size_t> prev (numblocks);
+  if (models){
+    LinkBlocks(instart, splitpoints, npoints, msize, &prev[0]);
+  }
+  size_t* order = ScheduleBlocks(instart, inend, splitpoints, npoints, models ? &prev[0] : 0);
   size_t i;
 
   for (i = 0; i < numblocks; i++) {
-    d[i].start = i == 0 ? 0 : splitpoints[i - 1];
+    d[i].start = i == 0 ? instart : splitpoints[i - 1];
     d[i].end = i == npoints ? inend : splitpoints[i];
     d[i].statsp = &statsp[i];
+    d[i].self = models ? ZopfliCostModelAt(models, i) : 0;
+    d[i].prev = models && prev[i] != numblocks ? ZopfliCostModelAt(models, prev[i]) : 0;
   }
-  BlockData* data = &d[0];
-  BlockData* blockend = data + numblocks;
-  std::mutex mtx;
+  std::atomic<size_t> next (0);
   for (i = 0; i < threads; i++) {
-    multi[i] = std::thread(DeflateDynamicBlock2,options, in, &data, blockend, std::ref(mtx));
+    multi[i] = std::thread(DeflateDynamicBlock2, options, in, &d[0], order, (size_t)numblocks, std::ref(next));
   }
   for(std::thread& t : multi) {
     t.join();
   }
+  free(order);
+  if (models){
+    ZopfliFreeCostModels(models);
+  }
 
   if (twiceMode & 1){
-    int j = 0;
-
-    for(;;){
-      ZopfliInitLZ77Store(twiceStore);
-      for(; j < numblocks; j++){
-        twiceStore->litlens = (unsigned short*)realloc(twiceStore->litlens, sizeof(unsigned short) * (twiceStore->size + d[j].store.size));
-        twiceStore->dists = (unsigned short*)realloc(twiceStore->dists, sizeof(unsigned short) * (twiceStore->size + d[j].store.size));
-        memcpy(twiceStore->litlens + twiceStore->size, d[j].store.litlens, d[j].store.size * sizeof(unsigned short));
-        memcpy(twiceStore->dists + twiceStore->size, d[j].store.dists, d[j].store.size * sizeof(unsigned short));
-        free(d[j].store.dists);
-        free(d[j].store.litlens);
-        twiceStore->size += d[j].store.size;
-        if(d[j].end == mnext){
-          mnext += msize;
-          j++;
-          break;
-        }
-      }
-
-      if(j == numblocks){
-        break;
+    /* Hand the stores of the blocks to their master block without copying. */
+    for (size_t j = 0; j < numblocks; j++) {
+      ZOPFLI_APPEND_DATA(d[j].store, &twiceStore->stores, &twiceStore->n);
+      if (d[j].end == mnext){
+        mnext += msize;
+        twiceStore++;
       }
-      twiceStore++;
     }
   }
   else{
     for (i = 0; i < numblocks; i++) {
-      size_t start = i == 0 ? 0 : splitpoints[i - 1];
+      size_t start = i == 0 ? instart : splitpoints[i - 1];
       size_t end = i == npoints ? inend : splitpoints[i];
 
       AddLZ77Block(d[i].btype, i == npoints && final,
@@ -1240,45 +1530,40 @@ static void DeflateSplittingFirst2(
 }
 
 static void ZopfliDeflateMulti(const ZopfliOptions* options, int final,
-                               const unsigned char* in, const size_t insize,
+                               const unsigned char* in, size_t instart, size_t inend,
                                unsigned char* bp, unsigned char** out, size_t* outsize){
-  size_t msize = ZOPFLI_MASTER_BLOCK_SIZE;
-
-  if (!options->isPNG && options->numiterations == 1){
-    msize /= 5;
-  }
-  ZopfliLZ77Store* lf = 0;//!
-  ZopfliLZ77Store dummy;
+  size_t msize = ZopfliMasterBlockSize(options);
+  ZopfliLZ77Segments* lf = 0;//!
   if(options->twice){
-    lf = (ZopfliLZ77Store*)malloc(((insize / msize) + 1) * sizeof(ZopfliLZ77Store));
+    lf = (ZopfliLZ77Segments*)malloc((((inend - instart) / msize) + 1) * sizeof(ZopfliLZ77Segments));
     if(!lf){
       return;
     }
   }
 
   for (int it = 0; it <= options->twice; it++) {
-    size_t i = 0;
+    size_t i = instart;
     size_t npoints = 0;
     size_t* splitpoints = 0;
     SymbolStats* stats = 0;
 
     unsigned mblocks = 0;
-    while (i < insize) {
+    while (i < inend) {
       if(it == 0 && options->twice){
-        ZopfliInitLZ77Store(lf + mblocks);
+        ZopfliInitLZ77Segments(lf + mblocks);
       }
 
-      int masterfinal = (i + msize >= insize);
-      size_t size = masterfinal ? insize - i : msize;
-      ZopfliBlockSplit(options, in, i, i + size, &splitpoints, &npoints, &stats, 1 + (!!it), it ? lf[mblocks] : dummy);
-      if(i + size < insize){
+      int masterfinal = (i + msize >= inend);
+      size_t size = masterfinal ? inend - i : msize;
+      ZopfliBlockSplit(options, in, i, i + size, &splitpoints, &npoints, &stats, 1 + (!!it), it ? lf + mblocks : 0);
+      if(i + size < inend){
         ZOPFLI_APPEND_DATA(i + size, &splitpoints, &npoints);
       }
       mblocks++;
       i += size;
     }
 
-    DeflateSplittingFirst2(options, final, in, insize, bp,
+    DeflateSplittingFirst2(options, final, in, instart, inend, bp,
                            out, outsize, npoints, splitpoints, stats,
                            options->twice && it != options->twice, lf, msize);
   }
@@ -1288,9 +1573,29 @@ static void ZopfliDeflateMulti(const ZopfliOptions* options, int final,
 }
 #endif
 
+/* Block splitting result of a master block. */
+struct MasterSplit {
+  size_t* splitpoints;
+  size_t npoints;
+  SymbolStats* statsp;
+};
+
+#ifndef NOMULTI
+/* Splits a master block ahead of time. Only uses the lazy LZ77 parse, so it
+ doesn't touch the thread local cost model of the squeezing thread. */
+static void SplitMasterBlock(const ZopfliOptions* options, const unsigned char* in,
+                             size_t instart, size_t inend, MasterSplit* split) {
+  split->splitpoints = 0;
+  split->npoints = 0;
+  split->statsp = 0;
+  ZopfliBlockSplit(options, in, instart, inend, &split->splitpoints, &split->npoints, &split->statsp, 0, 0);
+}
+#endif
+
 /*
  Does squeeze strategy where first block splitting is done, then each block is
  squeezed.
+ presplit: block splitting of this master block if already done, else NULL.
  Parameters: see description of the ZopfliDeflate function.
  */
 static void DeflateSplittingFirst(const ZopfliOptions* options,
@@ -1298,11 +1603,19 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
                                   const unsigned char* in,
                                   size_t instart, size_t inend,
                                   unsigned char* bp,
-                                  unsigned char** out, size_t* outsize, unsigned char* costmodelnotinited, unsigned char twiceMode, ZopfliLZ77Store* twiceStore) {
+                                  unsigned char** out, size_t* outsize, unsigned char twiceMode, ZopfliLZ77Segments* twiceStore,
+                                  const MasterSplit* presplit) {
   size_t* splitpoints = 0;
   size_t npoints = 0;
   SymbolStats* statsp = 0;
-  ZopfliBlockSplit(options, in, instart, inend, &splitpoints, &npoints, &statsp, twiceMode, *twiceStore);
+  if (presplit){
+    splitpoints = presplit->splitpoints;
+    npoints = presplit->npoints;
+    statsp = presplit->statsp;
+  }
+  else{
+    ZopfliBlockSplit(options, in, instart, inend, &splitpoints, &npoints, &statsp, twiceMode, twiceStore);
+  }
 
   ZopfliLZ77Store* stores = nullptr;
   if (twiceMode & 1){
@@ -1311,26 +1624,29 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
       exit(1);
     }
   }
+  /* Link blocks like the multithreaded path does, so the output is the same. */
+  ZopfliCostModel* models = ZopfliAllocCostModels(options, npoints + 1);
+  size_t* prev = 0;
+  if (models){
+    prev = (size_t*)malloc((npoints + 1) * sizeof(size_t));
+    if (!prev) exit(1); /* Allocation failed. */
+    LinkBlocks(instart, splitpoints, npoints, inend - instart, prev);
+  }
   for (size_t i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints[i - 1];
     size_t end = i == npoints ? inend : splitpoints[i];
     unsigned x = npoints == 0 ? 0 : i == 0 ? 2 : i == npoints ? 1 : 3;
     DeflateDynamicBlock(options, i == npoints && final, in, start, end,
-                        bp, out, outsize, costmodelnotinited, &(statsp[i]), twiceMode, stores + i, x);
+                        bp, out, outsize, &(statsp[i]), prev && prev[i] <= npoints ? ZopfliCostModelAt(models, prev[i]) : 0,
+                        models ? ZopfliCostModelAt(models, i) : 0, twiceMode, stores + i, x);
+  }
+  if (models){
+    ZopfliFreeCostModels(models);
+    free(prev);
   }
   if (twiceMode & 1){
-    ZopfliInitLZ77Store(twiceStore);
-    for(int i = 0; i < npoints + 1; i++){
-      twiceStore->litlens = (unsigned short*)realloc(twiceStore->litlens, sizeof(unsigned short) * (twiceStore->size + stores->size));
-      twiceStore->dists = (unsigned short*)realloc(twiceStore->dists, sizeof(unsigned short) * (twiceStore->size + stores->size));
-      memcpy(twiceStore->litlens + twiceStore->size, stores->litlens, stores->size * sizeof(unsigned short));
-      memcpy(twiceStore->dists + twiceStore->size, stores->dists, stores->size * sizeof(unsigned short));
-      free(stores->dists);
-      free(stores->litlens);
-      twiceStore->size += stores->size;
-      stores++;
-    }
-    free(stores - (npoints + 1));
+    twiceStore->stores = stores;
+    twiceStore->n = npoints + 1;
   }
 
   free(splitpoints);
@@ -1349,55 +1665,289 @@ the final bit will be set on the last block.
 static void ZopfliDeflatePart(const ZopfliOptions* options, int final,
                        const unsigned char* in, size_t instart, size_t inend,
                        unsigned char* bp, unsigned char** out,
-                       size_t* outsize, unsigned char* costmodelnotinited, unsigned char twiceMode, ZopfliLZ77Store* twiceStore) {
-  DeflateSplittingFirst(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, twiceMode, twiceStore);
+                       size_t* outsize, unsigned char twiceMode, ZopfliLZ77Segments* twiceStore,
+                       const MasterSplit* presplit) {
+  DeflateSplittingFirst(options, final, in, instart, inend, bp, out, outsize, twiceMode, twiceStore, presplit);
+}
+
+/*
+Hands the complete bytes of the output to options->flush and removes them from
+the buffer. A partially written last byte stays.
+*/
+static void FlushOutput(const ZopfliOptions* options, unsigned char bp, unsigned char** out, size_t* outsize) {
+  if (!options->flush || options->checkpoint){
+    return;
+  }
+  size_t n = *outsize - (bp != 0);
+  options->flush(options->flushopaque, *out, n);
+  if (bp){
+    (*out)[0] = (*out)[n];
+  }
+  *outsize -= n;
 }
 
 /*TODO: in needs to be alloc'd 8 bytes past inend. This may cause crashes if code is modified and nonstandard alloc function is used for allocation of in*/
+/* Adds a fixed block holding only the end symbol. */
+static void AddEmptyBlock(int final, unsigned char* bp, unsigned char** out, size_t* outsize) {
+  (*out) = (unsigned char*)realloc(*out, *outsize + 10);
+  if (!(*out)){
+    exit(1);
+  }
+  BitWriter w;
+  BitWriterInit(&w, *out, *outsize, *bp);
+  WriteBits(&w, final | (1 << 1), 3);  // btype 01
+  WriteBits(&w, 0, 7);  // end symbol
+  BitWriterFinish(&w, bp, outsize);
+}
+
+/* Squeezes the master block in[instart, inend) on this thread. */
+static void DeflateMasterBlock(const ZopfliOptions* options, int final,
+                               const unsigned char* in, size_t instart, size_t inend,
+                               unsigned char* bp, unsigned char** out, size_t* outsize,
+                               const MasterSplit* presplit) {
+  ZopfliLZ77Segments lf;
+  ZopfliInitLZ77Segments(&lf);
+  if (!options->twice){
+    ZopfliDeflatePart(options, final, in, instart, inend, bp, out, outsize, 0, &lf, presplit);
+  }
+  else{
+    ZopfliDeflatePart(options, final, in, instart, inend, bp, out, outsize, 1, &lf, presplit);
+    for (int it = 0; it < options->twice; it++) {
+      ZopfliDeflatePart(options, final, in, instart, inend, bp, out, outsize, 2 + (it != options->twice - 1), &lf, 0);
+    }
+  }
+}
+
+static int UseChunks(const ZopfliOptions* options) {
+  return options->chunksize && options->multithreading > 1;
+}
+
+size_t ZopfliStreamBlockSize(const ZopfliOptions* options) {
+  return UseChunks(options) ? (size_t)options->chunksize * options->multithreading : ZopfliMasterBlockSize(options);
+}
+
+#ifndef NOMULTI
+/* Adds an empty stored block, which ends the output on a byte boundary. */
+static void AddSyncBlock(unsigned char* bp, unsigned char** out, size_t* outsize) {
+  (*out) = (unsigned char*)realloc(*out, *outsize + 6);
+  if (!(*out)){
+    exit(1);
+  }
+  BitWriter w;
+  BitWriterInit(&w, *out, *outsize, *bp);
+  WriteBits(&w, 0, 3);  // btype 00
+  BitWriterFinish(&w, bp, outsize);
+  *bp = 0;  // The rest of the byte is padding.
+  unsigned char* o = &(*out)[*outsize];
+  o[0] = o[1] = 0;
+  o[2] = o[3] = 255;
+  (*outsize) += 4;
+}
+
+/*
+Compresses in[instart, inend) as chunks of options->chunksize bytes, one per
+thread at a time. A chunk only depends on the ZOPFLI_WINDOW_SIZE bytes before it.
+All but the last chunk of the stream end with an empty stored block, so the
+outputs of the chunks can be concatenated.
+*/
+static void DeflateChunks(const ZopfliOptions* options, int final,
+                          const unsigned char* in, size_t instart, size_t inend,
+                          unsigned char* bp, unsigned char** out, size_t* outsize) {
+  size_t nchunks = (inend - instart + options->chunksize - 1) / options->chunksize;
+  std::vector<unsigned char*> chunkout(nchunks, 0);
+  std::vector<size_t> chunkoutsize(nchunks, 0);
+  std::vector<unsigned char> chunkbp(nchunks, 0);
+  ZopfliOptions chunkoptions = *options;
+  chunkoptions.multithreading = 1;
+  chunkoptions.checkpoint = 0;
+  chunkoptions.flush = 0;
+  size_t msize = ZopfliMasterBlockSize(options);
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (;;) {
+      size_t k = next++;
+      if (k >= nchunks){
+        return;
+      }
+      size_t start = instart + k * options->chunksize;
+      size_t end = k + 1 == nchunks ? inend : start + options->chunksize;
+      for (size_t i = start; i < end; i += msize) {
+        size_t mend = end - i <= msize ? end : i + msize;
+        ZopfliDeflateMaster(&chunkoptions, final && mend == inend, in, i, mend, &chunkbp[k], &chunkout[k], &chunkoutsize[k]);
+      }
+      if (!final || end != inend){
+        AddSyncBlock(&chunkbp[k], &chunkout[k], &chunkoutsize[k]);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < options->multithreading && t < nchunks; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  if (*bp){
+    AddSyncBlock(bp, out, outsize);
+  }
+  for (size_t k = 0; k < nchunks; k++) {
+    (*out) = (unsigned char*)realloc(*out, *outsize + chunkoutsize[k]);
+    if (!(*out)){
+      exit(1);
+    }
+    memcpy(*out + *outsize, chunkout[k], chunkoutsize[k]);
+    *outsize += chunkoutsize[k];
+    *bp = chunkbp[k];
+    free(chunkout[k]);
+    FlushOutput(options, *bp, out, outsize);
+  }
+}
+#endif
+
+void ZopfliDeflateMaster(const ZopfliOptions* options, int final,
+                         const unsigned char* in, size_t instart, size_t inend,
+                         unsigned char* bp, unsigned char** out, size_t* outsize) {
+  if (instart == inend){
+    AddEmptyBlock(final, bp, out, outsize);
+  }
+#ifndef NOMULTI
+  else if (UseChunks(options)){
+    DeflateChunks(options, final, in, instart, inend, bp, out, outsize);
+  }
+#endif
+  else if (IsIncompressible(options, in, instart, inend)){
+    AddStoredBlocks(final, in, instart, inend, bp, out, outsize);
+  }
+  else if (options->fast){
+    DeflateFast(options, final, in, instart, inend, bp, out, outsize);
+  }
+#ifndef NOMULTI
+  else if (options->multithreading > 1 && inend - instart >= options->noblocksplit){
+    ZopfliDeflateMulti(options, final, in, instart, inend, bp, out, outsize);
+  }
+#endif
+  else{
+    DeflateMasterBlock(options, final, in, instart, inend, bp, out, outsize, 0);
+  }
+  FlushOutput(options, *bp, out, outsize);
+}
+
 void ZopfliDeflate(const ZopfliOptions* options, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize) {
   if (!insize){
-    (*out) = (unsigned char*)realloc(*out, *outsize + 10);
-    AddBit(final, bp, out, outsize);
-    AddBits(1, 2, bp, *out, outsize);  // btype 01
-    AddBits(0, 7, bp, *out, outsize);
+    AddEmptyBlock(final, bp, out, outsize);
     return;
   }
+#ifndef NOMULTI
+  if (UseChunks(options) && insize > options->chunksize){
+    DeflateChunks(options, final, in, 0, insize, bp, out, outsize);
+    return;
+  }
+#endif
+  if (options->fast){
+    size_t msize = ZopfliMasterBlockSize(options);
+    for (size_t i = 0; i < insize; i += msize) {
+      size_t end = i + msize >= insize ? insize : i + msize;
+      if (IsIncompressible(options, in, i, end)){
+        AddStoredBlocks(final && end == insize, in, i, end, bp, out, outsize);
+      }
+      else{
+        DeflateFast(options, final && end == insize, in, i, end, bp, out, outsize);
+      }
+      FlushOutput(options, *bp, out, outsize);
+    }
+    return;
+  }
+  ZopfliCheckpoint checkpoint;
+  size_t resume = ZopfliCheckpointOpen(&checkpoint, options, in, insize, bp, out, outsize);
 #ifndef NOMULTI
   if(options->multithreading > 1 && insize >= options->noblocksplit){
-    ZopfliDeflateMulti(options, final, in, insize, bp, out, outsize);
+    /* Runs of incompressible master blocks are stored, the others are
+     compressed together. With checkpoints, every master block is compressed
+     on its own, so its progress can be saved. When flushing, a run is limited
+     to one master block per thread to bound the output kept in memory. */
+    size_t msize = ZopfliMasterBlockSize(options);
+    size_t nmaster = (insize + msize - 1) / msize;
+    std::vector<char> stored(nmaster);
+    for (size_t m = 0; m < nmaster; m++) {
+      stored[m] = IsIncompressible(options, in, m * msize, m + 1 == nmaster ? insize : (m + 1) * msize);
+    }
+    for (size_t m = resume / msize; m < nmaster;) {
+      size_t n = m + 1;
+      while (!options->checkpoint && n < nmaster && stored[n] == stored[m]
+             && (!options->flush || n - m < options->multithreading)) {
+        n++;
+      }
+      size_t end = n == nmaster ? insize : n * msize;
+      if (stored[m]) {
+        AddStoredBlocks(final && n == nmaster, in, m * msize, end, bp, out, outsize);
+      }
+      else {
+        ZopfliDeflateMulti(options, final && n == nmaster, in, m * msize, end, bp, out, outsize);
+      }
+      if (n != nmaster) {
+        ZopfliCheckpointSave(&checkpoint, end, *bp, *out, *outsize);
+      }
+      FlushOutput(options, *bp, out, outsize);
+      m = n;
+    }
+    ZopfliCheckpointClose(&checkpoint);
     return;
   }
 #endif
 #if ZOPFLI_MASTER_BLOCK_SIZE == 0
-  ZopfliDeflatePart(options, final, in, 0, insize, bp, out, outsize, &costmodelnotinited);
+  ZopfliDeflatePart(options, final, in, 0, insize, bp, out, outsize);
 #else
 
-  size_t i = 0;
-  size_t msize = ZOPFLI_MASTER_BLOCK_SIZE;
-  unsigned char costmodelnotinited = 1;
-  if (!options->isPNG && options->numiterations == 1){
-    msize /= 5;
-  }
+  size_t i = resume;
+  size_t msize = ZopfliMasterBlockSize(options);
+  int stored = IsIncompressible(options, in, i, i + msize >= insize ? insize : i + msize);
+#ifndef NOMULTI
+  /* The block splitting of the next master block only depends on the input, so
+   it runs on a helper thread while the current one is squeezed. */
+  std::thread splitter;
+  MasterSplit next;
+#endif
   while (i < insize) {
     int masterfinal = (i + msize >= insize);
     int final2 = final && masterfinal;
     size_t size = masterfinal ? insize - i : msize;
-    ZopfliLZ77Store lf;
-    ZopfliInitLZ77Store(&lf);
-    if (!options->twice){
-      ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 0, &lf);
+    MasterSplit* presplit = 0;
+    int nextstored = 0;
+#ifndef NOMULTI
+    MasterSplit current;
+    if (splitter.joinable()){
+      splitter.join();
+      current = next;
+      presplit = &current;
     }
-    else{
-      unsigned char cache = costmodelnotinited;
-      ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 1, &lf);
-      for (int it = 0; it < options->twice; it++) {
-        costmodelnotinited = cache;
-        ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 2 + (it != options->twice - 1), &lf);
+#endif
+    if (!masterfinal){
+      size_t nextend = i + size + msize >= insize ? insize : i + size + msize;
+      nextstored = IsIncompressible(options, in, i + size, nextend);
+#ifndef NOMULTI
+      if (!nextstored){
+        splitter = std::thread(SplitMasterBlock, options, in, i + size, nextend, &next);
       }
+#endif
+    }
+    if (stored){
+      AddStoredBlocks(final2, in, i, i + size, bp, out, outsize);
+    }
+    else{
+      DeflateMasterBlock(options, final2, in, i, i + size, bp, out, outsize, presplit);
     }
     i += size;
+    stored = nextstored;
+    if (!masterfinal){
+      ZopfliCheckpointSave(&checkpoint, i, *bp, *out, *outsize);
+    }
+    FlushOutput(options, *bp, out, outsize);
   }
+  ZopfliCheckpointClose(&checkpoint);
 #endif
 }
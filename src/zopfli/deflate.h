@@ -56,6 +56,26 @@ void ZopfliDeflate(const ZopfliOptions* options, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize);
 
+/* Size of the master blocks ZopfliDeflate divides the input into. */
+size_t ZopfliMasterBlockSize(const ZopfliOptions* options);
+
+/*
+Amount of input to pass to ZopfliDeflateMaster at once: a master block, or in
+chunked mode a chunk for every thread.
+*/
+size_t ZopfliStreamBlockSize(const ZopfliOptions* options);
+
+/*
+Like ZopfliDeflate for in[instart, inend), which must not be larger than
+ZopfliStreamBlockSize. Up to ZOPFLI_WINDOW_SIZE bytes before instart are used as
+dictionary and in must be readable 8 bytes past inend. Compressing an input
+piece by piece gives the same output as ZopfliDeflate, without needing the
+whole input in memory. Checkpoints are not supported.
+*/
+void ZopfliDeflateMaster(const ZopfliOptions* options, int final,
+                         const unsigned char* in, size_t instart, size_t inend,
+                         unsigned char* bp, unsigned char** out, size_t* outsize);
+
 /*
 Calculates block size in bits.
 litlens: lz77 lit/lengths
@@ -27,9 +27,11 @@ Jyrki Katajainen, Alistair Moffat, Andrew Turpin".
 
 #include "katajainen.h"
 #include "util.h"
+#include "../threadLocal.h"
 
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <algorithm>
 
 /*
@@ -119,7 +121,7 @@ static void ExtractBitLengths(Node* chain, Node* leaves, unsigned* bitlengths) {
   }
 }
 
-void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+static void LengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
   int i;
   int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
 
@@ -166,7 +168,21 @@ void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbit
   for (i = 0; i < numsymbols; i++) {
     leaves[i].weight = (leaves[i].weight << 9) | leaves[i].count;
   }
-  std::sort(leaves, leaves + numsymbols, cmp);
+  if (numsymbols <= 32) {
+    /* Faster for the code length and distance alphabets. The keys are unique,
+    so the order is the same as with std::sort. */
+    for (i = 1; i < numsymbols; i++) {
+      Node leaf = leaves[i];
+      int j = i;
+      for (; j > 0 && leaves[j - 1].weight > leaf.weight; j--) {
+        leaves[j] = leaves[j - 1];
+      }
+      leaves[j] = leaf;
+    }
+  }
+  else {
+    std::sort(leaves, leaves + numsymbols, cmp);
+  }
 
   for (i = 0; i < numsymbols; i++) {
     leaves[i].weight >>= 9;
@@ -246,3 +262,65 @@ void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbit
 
   ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
 }
+
+/*
+Results of recent calls, kept per thread in direct mapped tables. The same
+histograms come up again and again, e.g. the code length code counts of the
+tree encodings tried for a block.
+*/
+template <int MAXN>
+struct CachedLengths {
+  unsigned long long hash;  /* 0 if unused. */
+  int n;
+  int maxbits;
+  unsigned frequencies[MAXN];
+  unsigned char bitlengths[MAXN];
+};
+
+static thread_local CachedLengths<32> smallcache[256];
+static thread_local CachedLengths<288> largecache[32];
+
+template <int MAXN>
+static void CachedLengthLimitedCodeLengths(CachedLengths<MAXN>* cache, size_t cachesize, unsigned long long hash,
+                                           const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+  CachedLengths<MAXN>* entry = &cache[(hash >> 32) & (cachesize - 1)];
+  int i;
+  if (entry->hash == hash && entry->n == n && entry->maxbits == maxbits) {
+    for (i = 0; i < n && entry->frequencies[i] == frequencies[i]; i++) {}
+    if (i == n) {
+      for (i = 0; i < n; i++) {
+        bitlengths[i] = entry->bitlengths[i];
+      }
+      return;
+    }
+  }
+  LengthLimitedCodeLengths(frequencies, n, maxbits, bitlengths);
+  entry->hash = hash;
+  entry->n = n;
+  entry->maxbits = maxbits;
+  for (i = 0; i < n; i++) {
+    entry->frequencies[i] = frequencies[i];
+    entry->bitlengths[i] = bitlengths[i];
+  }
+}
+
+void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+  unsigned long long hash = (n << 4) + maxbits;
+  for (int i = 0; i < n; i++) {
+    if (frequencies[i] > UINT_MAX) {
+      LengthLimitedCodeLengths(frequencies, n, maxbits, bitlengths);
+      return;
+    }
+    hash = (hash ^ frequencies[i]) * 0x100000001B3ULL;
+  }
+  hash |= 1;
+  if (n <= 32) {
+    CachedLengthLimitedCodeLengths(smallcache, 256, hash, frequencies, n, maxbits, bitlengths);
+  }
+  else if (n <= 288) {
+    CachedLengthLimitedCodeLengths(largecache, 32, hash, frequencies, n, maxbits, bitlengths);
+  }
+  else {
+    LengthLimitedCodeLengths(frequencies, n, maxbits, bitlengths);
+  }
+}
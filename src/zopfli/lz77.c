@@ -22,6 +22,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "lz77.h"
 #include "util.h"
 #include "match.h"
+#include "../threadLocal.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -40,6 +41,19 @@ void ZopfliCleanLZ77Store(ZopfliLZ77Store* store) {
   free(store->dists);
 }
 
+void ZopfliInitLZ77Segments(ZopfliLZ77Segments* segments) {
+  segments->stores = 0;
+  segments->n = 0;
+}
+
+void ZopfliCleanLZ77Segments(ZopfliLZ77Segments* segments) {
+  for (size_t i = 0; i < segments->n; i++) {
+    ZopfliCleanLZ77Store(&segments->stores[i]);
+  }
+  free(segments->stores);
+  ZopfliInitLZ77Segments(segments);
+}
+
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
   ZopfliCleanLZ77Store(dest);
   dest->litlens = (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
@@ -57,11 +71,16 @@ void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
 Appends the length and distance to the LZ77 arrays of the ZopfliLZ77Store.
 context must be a ZopfliLZ77Store*.
 */
-static void ZopfliStoreLitLenDist(unsigned short length, unsigned char dist,
+static void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist, unsigned char symbols,
                            ZopfliLZ77Store* store) {
   size_t size2 = store->size;  /* Needed for using ZOPFLI_APPEND_DATA twice. */
   ZOPFLI_APPEND_DATA(length, &store->litlens, &store->size);
-  ZOPFLI_APPEND_DATA(dist, (unsigned char**)&store->dists, &size2);
+  if (symbols){
+    ZOPFLI_APPEND_DATA((unsigned char)dist, (unsigned char**)&store->dists, &size2);
+  }
+  else{
+    ZOPFLI_APPEND_DATA(dist, &store->dists, &size2);
+  }
 }
 
 #ifndef NDEBUG
@@ -135,6 +154,7 @@ typedef struct
   U16   chainTable[MAXD];
   const BYTE* base;       /* All index relative to this position */
   U32   nextToUpdate;     /* index from which to continue dictionary update */
+  U32   lowest;           /* index of the first byte, older entries are stale */
 } LZ4HC_Data_Structure;
 typedef struct
 {
@@ -142,6 +162,7 @@ typedef struct
   U16   chainTable[MAXD3];
   const BYTE* base;       /* All index relative to this position */
   U32   nextToUpdate;     /* index from which to continue dictionary update */
+  U32   lowest;           /* index of the first byte, older entries are stale */
 } LZ3HC_Data_Structure;
 
 #ifdef __SSE4_2__
@@ -156,21 +177,33 @@ static U32 LZ4HC_hashPtr(const void* ptr) { return HASH_FUNCTION(*(unsigned*)ptr
 static U32 LZ4HC_hashPtr3(const void* ptr) { return HASH_FUNCTION3((*(unsigned*)ptr) & 0xFFFFFF); }
 #endif
 
-static void LZ4HC_init (LZ4HC_Data_Structure* hc4, const BYTE* start)
+/* The tables are reused between calls. New indices start above all entries of
+earlier calls, which then fail the lowLimit check, so the tables only need to be
+cleared when the indices would overflow. Chain entries are always written before
+they are read. */
+static void LZ4HC_init (LZ4HC_Data_Structure* hc4, const BYTE* start, size_t size)
 {
-  memset((void*)hc4->hashTable, 0, sizeof(hc4->hashTable));
-  memset(hc4->chainTable, 0xFF, sizeof(hc4->chainTable));
+  if (!hc4->base || 0xFFFFFFFFU - hc4->nextToUpdate < size + 2 * MAXD)
+  {
+    memset((void*)hc4->hashTable, 0, sizeof(hc4->hashTable));
+    hc4->nextToUpdate = 0;
+  }
 
-  hc4->nextToUpdate = MAXD;
-  hc4->base = start - MAXD;
+  hc4->lowest = hc4->nextToUpdate + MAXD;
+  hc4->nextToUpdate = hc4->lowest;
+  hc4->base = start - hc4->lowest;
 }
-static void LZ4HC_init3 (LZ3HC_Data_Structure* hc4, const BYTE* start)
+static void LZ4HC_init3 (LZ3HC_Data_Structure* hc4, const BYTE* start, size_t size)
 {
-  memset((void*)hc4->hashTable, 0, sizeof(hc4->hashTable));
-  memset(hc4->chainTable, 0xFF, sizeof(hc4->chainTable));
+  if (!hc4->base || 0xFFFFFFFFU - hc4->nextToUpdate < size + 2 * MAXD3)
+  {
+    memset((void*)hc4->hashTable, 0, sizeof(hc4->hashTable));
+    hc4->nextToUpdate = 0;
+  }
 
-  hc4->nextToUpdate = MAXD3;
-  hc4->base = start - MAXD3;
+  hc4->lowest = hc4->nextToUpdate + MAXD3;
+  hc4->nextToUpdate = hc4->lowest;
+  hc4->base = start - hc4->lowest;
 }
 
 /* Update chains up to ip (excluded) */
@@ -225,7 +258,7 @@ static int LZ4HC_InsertAndFindBestMatch(LZ4HC_Data_Structure* hc4,   /* Index ta
   U16* const chainTable = hc4->chainTable;
   U32* const HashTable = hc4->hashTable;
   const BYTE* const base = hc4->base;
-  const U32 lowLimit = (2 * MAXD > (U32)(ip-base)) ? MAXD : (U32)(ip - base) - (MAXD - 1);
+  const U32 lowLimit = (hc4->lowest + MAXD > (U32)(ip-base)) ? hc4->lowest : (U32)(ip - base) - (MAXD - 1);
   const BYTE* match;
   int nbAttempts = 650; //PNG 650//ENWIK 600/700
   size_t ml=3;
@@ -264,7 +297,7 @@ static int LZ4HC_InsertAndFindBestMatch3 (LZ3HC_Data_Structure* hc4,   /* Index
   U16* const chainTable = hc4->chainTable;
   U32* const HashTable = hc4->hashTable;
   const BYTE* const base = hc4->base;
-  const U32 lowLimit = (2 * MAXD3 > (U32)(ip-base)) ? MAXD3 : (U32)(ip - base) - (MAXD3 - 1);
+  const U32 lowLimit = (hc4->lowest + MAXD3 > (U32)(ip-base)) ? hc4->lowest : (U32)(ip - base) - (MAXD3 - 1);
 
   /* HC3 match finder */
   LZ4HC_Insert3(hc4, ip);
@@ -304,18 +337,32 @@ size_t ZopfliLZ77LazyLauncher(const unsigned char* in,
 
   ZopfliLZ77Lazy(&options, in,
                  instart, inend,
-                 &store);
+                 &store, 1);
   size_t ret = ZopfliCalculateBlockSize(store.litlens, store.dists, 0, store.size, 2, 0, 1);
   ZopfliCleanLZ77Store(&store);
   return ret;
 }
 
+/* Stores a match either as symbols or as plain length and distance. */
+static void StoreMatch(unsigned short leng, unsigned short dist, unsigned char symbols, ZopfliLZ77Store* store) {
+  if (symbols){
+    unsigned lls = ZopfliGetLengthSymbol(leng);
+    ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, 1, store);
+  }
+  else{
+    ZopfliStoreLitLenDist(leng, dist, 0, store);
+  }
+}
+
+static thread_local LZ4HC_Data_Structure lazymmc;
+static thread_local LZ3HC_Data_Structure lazyh3;
+
 void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
                       size_t instart, size_t inend,
-                      ZopfliLZ77Store* store) {
+                      ZopfliLZ77Store* store, unsigned char symbols) {
 
-  LZ4HC_Data_Structure mmc;
-  LZ3HC_Data_Structure h3;
+  LZ4HC_Data_Structure* mmc = &lazymmc;
+  LZ3HC_Data_Structure* h3 = &lazyh3;
   size_t i = 0;
   unsigned short leng;
   unsigned short dist;
@@ -327,21 +374,22 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
   unsigned prev_match = 0;
   unsigned char match_available = 0;
 
-  LZ4HC_init(&mmc, &in[windowstart]);
-  LZ4HC_init3(&h3, &in[instart > MAXD3 ? instart - MAXD3 : 0]);
+  size_t h3start = instart > MAXD3 ? instart - MAXD3 : 0;
+  LZ4HC_init(mmc, &in[windowstart], inend - windowstart);
+  LZ4HC_init3(h3, &in[h3start], inend - h3start);
 
 
   for (i = instart; i < inend; i++) {
 
     const BYTE* matchpos;
-    int y = LZ4HC_InsertAndFindBestMatch(&mmc, &in[i], &in[inend] > &in[i] + ZOPFLI_MAX_MATCH ? &in[i] + ZOPFLI_MAX_MATCH : &in[inend], &matchpos);
+    int y = LZ4HC_InsertAndFindBestMatch(mmc, &in[i], &in[inend] > &in[i] + ZOPFLI_MAX_MATCH ? &in[i] + ZOPFLI_MAX_MATCH : &in[inend], &matchpos);
 
     if (y >= 4 && i + 4 <= inend){
       dist = &in[i] - matchpos;
       leng = y;
     }
     else if (!match_available){
-      y = LZ4HC_InsertAndFindBestMatch3(&h3, &in[i], &in[inend], &matchpos);
+      y = LZ4HC_InsertAndFindBestMatch3(h3, &in[i], &in[inend], &matchpos);
       if (y == 3){
       leng = 3;
       dist = &in[i] - matchpos;
@@ -366,7 +414,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
     if (match_available) {
       match_available = 0;
       if (lengthscore > prev_length + 1) {
-        ZopfliStoreLitLenDist(in[i - 1], 0, store);
+        ZopfliStoreLitLenDist(in[i - 1], 0, symbols, store);
 
         if (lengthscore >= ZOPFLI_MIN_MATCH) {
           match_available = 1;
@@ -383,8 +431,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
         ZopfliVerifyLenDist(in, inend, i - 1, dist, leng);
 #endif
 
-        unsigned lls = ZopfliGetLengthSymbol(leng);
-        ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+        StoreMatch(leng, dist, symbols, store);
         i += leng - 2;
         continue;
       }
@@ -401,12 +448,11 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
 #ifndef NDEBUG
         ZopfliVerifyLenDist(in, inend, i, dist, leng);
 #endif
-      unsigned lls = ZopfliGetLengthSymbol(leng);
-      ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+      StoreMatch(leng, dist, symbols, store);
 
     } else {
       leng = 1;
-      ZopfliStoreLitLenDist(in[i], 0, store);
+      ZopfliStoreLitLenDist(in[i], 0, symbols, store);
     }
     i += leng - 1;
   }
@@ -55,6 +55,19 @@ void ZopfliInitLZ77Store(ZopfliLZ77Store* store);
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store);
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest);
 
+/*
+LZ77 data kept as consecutive stores instead of one concatenated store, so the
+parts can be passed on without copying. ZopfliCleanLZ77Segments frees the stores
+and the array.
+*/
+typedef struct ZopfliLZ77Segments {
+  ZopfliLZ77Store* stores;
+  size_t n;
+} ZopfliLZ77Segments;
+
+void ZopfliInitLZ77Segments(ZopfliLZ77Segments* segments);
+void ZopfliCleanLZ77Segments(ZopfliLZ77Segments* segments);
+
 /*
 Verifies if length and dist are indeed valid, only used for assertion.
 */
@@ -80,13 +93,14 @@ void ZopfliLZ77Counts(const unsigned short* litlens,
 /*
 Does LZ77 using an algorithm similar to gzip, with lazy matching, rather than
 with the slow but better "squeeze" implementation.
-The result is placed in the ZopfliLZ77Store.
+The result is placed in the ZopfliLZ77Store, as length and distance symbols if
+symbols is set, otherwise as plain lengths and distances.
 If instart is larger than 0, it uses values before instart as starting
 dictionary.
 */
 void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
                       size_t instart, size_t inend,
-                      ZopfliLZ77Store* store);
+                      ZopfliLZ77Store* store, unsigned char symbols);
 
 #ifdef __cplusplus
 }
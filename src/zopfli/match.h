@@ -15,6 +15,11 @@
  end is the last possible byte, beyond which to stop looking.
  safe_end is a few (8) bytes before end, for comparing multiple bytes at once.
  */
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#include <emmintrin.h>
+#define MATCH_SSE2
+#endif
+
 #ifdef __GNUC__
 __attribute__ ((always_inline, hot))
 #endif
@@ -22,15 +27,31 @@ static inline const unsigned char* GetMatch(const unsigned char* scan,
                                             const unsigned char* match,
                                             const unsigned char* end
                                             , const unsigned char* safe_end) {
+#ifdef MATCH_SSE2
+  /* Compare 16 bytes at once while they fit before end. */
+  while (end - scan >= 16) {
+    __m128i sv = _mm_loadu_si128((const __m128i*)(const void*)scan);
+    __m128i mv = _mm_loadu_si128((const __m128i*)(const void*)match);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(sv, mv)) ^ 0xFFFF;
+    if (mask) {
+      return scan + __builtin_ctz(mask);
+    }
+    scan += 16;
+    match += 16;
+  }
+  if (scan == end) {
+    return end;
+  }
+#endif
 #if defined(__GNUC__)
   /* Optimized Function based on cloudflare's zlib fork.*/
   if (sizeof(size_t) == 8) {
     do {
       size_t sv = *(size_t*)(void*)scan;
       size_t mv = *(size_t*)(void*)match;
-      size_t xor = sv ^ mv;
-      if (xor) {
-        scan += __builtin_ctzll(xor) / 8;
+      size_t diff = sv ^ mv;
+      if (diff) {
+        scan += __builtin_ctzll(diff) / 8;
         break;
       }
       scan += 8;
@@ -25,6 +25,11 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <stdio.h>
 #include <string.h>
 
+#ifndef NOMULTI
+#include <mutex>
+#include <condition_variable>
+#endif
+
 #include "blocksplitter.h"
 #include "deflate.h"
 #include "katajainen.h"
@@ -43,6 +48,67 @@ static void CopyStats(const SymbolStats* source, SymbolStats* dest) {
   memcpy(dest->d_symbols, source->d_symbols, 32 * sizeof(dest->d_symbols[0]));
 }
 
+struct ZopfliCostModel {
+  SymbolStats stats;
+  /* 0: not published yet, 1: stats valid, 2: published without stats. */
+  int state;
+#ifndef NOMULTI
+  std::mutex mtx;
+  std::condition_variable cv;
+#endif
+};
+
+ZopfliCostModel* ZopfliAllocCostModels(const ZopfliOptions* options, size_t n) {
+  /* With few iterations a block would mostly wait for its predecessor. */
+  if (options->numiterations < 8) {
+    return 0;
+  }
+  ZopfliCostModel* models = new ZopfliCostModel[n];
+  for (size_t i = 0; i < n; i++) {
+    models[i].state = 0;
+  }
+  return models;
+}
+
+void ZopfliFreeCostModels(ZopfliCostModel* models) {
+  delete[] models;
+}
+
+ZopfliCostModel* ZopfliCostModelAt(ZopfliCostModel* models, size_t i) {
+  return models + i;
+}
+
+void ZopfliPublishCostModel(ZopfliCostModel* model, const SymbolStats* stats) {
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(model->mtx);
+#endif
+  if (model->state) {
+    return;
+  }
+  if (stats) {
+    CopyStats(stats, &model->stats);
+  }
+  model->state = stats ? 1 : 2;
+#ifndef NOMULTI
+  model->cv.notify_all();
+#endif
+}
+
+/* Waits until model is published. Returns 1 and copies it to stats if it has
+statistics. */
+static int WaitCostModel(ZopfliCostModel* model, SymbolStats* stats) {
+#ifndef NOMULTI
+  std::unique_lock<std::mutex> lock(model->mtx);
+  model->cv.wait(lock, [model]{ return model->state != 0; });
+#endif
+  assert(model->state);
+  if (model->state != 1) {
+    return 0;
+  }
+  CopyStats(&model->stats, stats);
+  return 1;
+}
+
 static void MixCostmodels(const SymbolStats* src, SymbolStats* prod, float share){
   for (unsigned i = 0; i < 288; i++) {
     prod->ll_symbols[i] = prod->ll_symbols[i] * (1.0 - share) + src->ll_symbols[i] * share;
@@ -217,70 +283,100 @@ static int LZ4HC_InsertAndFindBestMatch3 (LZ3HC_Data_Structure* hc4,   /* Index
   return num;
 }
 
-static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inend,
-                           SymbolStats* costcontext, unsigned* length_array, LZCache* c) {
-  size_t i;
+/*
+The optimal parser works either with float costs in bits or, when
+options->fixedcost is set, with integer costs in 1/COST_SCALE bits. Integer
+costs compare faster and the chosen path doesn't change with -Ofast or other
+float optimizations.
+*/
+#define COST_SCALE 16
 
-  /*TODO: Put this in seperate function*/
-  float litlentable [259];
-  float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
-  float* literals = costcontext->ll_symbols;
-  if (!disttable){
-    exit(1);
-  }
-    for (i = 3; i < 259; i++){
-      litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 0; i < 1025; i++){
-      disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
+template<typename T> static inline T ScaleCost(float bits);
+template<> inline float ScaleCost<float>(float bits) {
+  return bits;
+}
+template<> inline unsigned ScaleCost<unsigned>(float bits) {
+  return (unsigned)(bits * COST_SCALE + 0.5f);
+}
+
+/* Fills the cost tables for a dynamic block, or the fixed tree if costcontext is
+NULL. Only the costs of distances below distend are set. */
+template<typename T>
+static void GetCostTables(const SymbolStats* costcontext, T* literals, T* litlentable, T* disttable, size_t distend) {
+  size_t i;
+  if (costcontext){  /* Dynamic Block */
+    for (i = 0; i < 256; i++){
+      literals[i] = ScaleCost<T>(costcontext->ll_symbols[i]);
     }
-    float counter = costcontext->d_symbols[20] + 9;
-    for (; i < 1537; i++){
-      disttable[i] = counter;
+    for (i = 3; i < 259; i++){
+      litlentable[i] = ScaleCost<T>(costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i));
+    }
+    for (i = 0; i < 513 && i < distend; i++){
+      disttable[i] = ScaleCost<T>(costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i));
+    }
+    /* Dist symbols 18 to 29 cover the dists up to 3 or 4 << extra bits. */
+    for (unsigned symbol = 18; symbol < 30; symbol++){
+      unsigned extra = (symbol - 2) / 2;
+      T counter = ScaleCost<T>(costcontext->d_symbols[symbol] + extra);
+      size_t last = (symbol & 1 ? 4 : 3) << extra;
+      for (; i <= last && i < distend; i++){
+        disttable[i] = counter;
+      }
     }
-    counter = costcontext->d_symbols[21] + 9;
-    for (; i < 2049; i++){
-      disttable[i] = counter;
+  }
+  else {
+    for (i = 0; i < 144; i++){
+      literals[i] = ScaleCost<T>(8);
     }
-    counter = costcontext->d_symbols[22] + 10;
-    for (; i < 3073; i++){
-      disttable[i] = counter;
+    for (; i < 256; i++){
+      literals[i] = ScaleCost<T>(9);
     }
-    counter = costcontext->d_symbols[23] + 10;
-    for (; i < 4097; i++){
-      disttable[i] = counter;
+    for (i = 3; i < 259; i++){
+      litlentable[i] = ScaleCost<T>(12 + (i > 114) + ZopfliGetLengthExtraBits(i));
     }
-    counter = costcontext->d_symbols[24] + 11;
-    for (; i < 6145; i++){
-      disttable[i] = counter;
+    for (i = 0; i < 1025 && i < distend; i++){
+      disttable[i] = ScaleCost<T>(ZopfliGetDistExtraBits(i));
     }
-    counter = costcontext->d_symbols[25] + 11;
-    for (; i < 8193; i++){
-      disttable[i] = counter;
+    for (; i < 2049 && i < distend; i++){
+      disttable[i] = ScaleCost<T>(9);
     }
-    counter = costcontext->d_symbols[26] + 12;
-    for (; i < 12289; i++){
-      disttable[i] = counter;
+    for (; i < 4097 && i < distend; i++){
+      disttable[i] = ScaleCost<T>(10);
     }
-    counter = costcontext->d_symbols[27] + 12;
-    for (; i < 16385; i++){
-      disttable[i] = counter;
+    for (; i < 8193 && i < distend; i++){
+      disttable[i] = ScaleCost<T>(11);
     }
-    counter = costcontext->d_symbols[28] + 13;
-    for (; i < 24577; i++){
-      disttable[i] = counter;
+    for (; i < 16385 && i < distend; i++){
+      disttable[i] = ScaleCost<T>(12);
     }
-    counter = costcontext->d_symbols[29] + 13;
-    for (; i < 32768; i++){
-      disttable[i] = counter;
+    for (; i < distend; i++){
+      disttable[i] = ScaleCost<T>(13);
     }
+  }
+}
+
+template<typename T>
+static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inend,
+                           const SymbolStats* costcontext, unsigned* length_array, LZCache* c) {
+  size_t i;
+
+  T literals[256];
+  T litlentable[259];
+  /* No match can reach back further than windowstart. */
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  size_t distend = inend - windowstart < ZOPFLI_WINDOW_SIZE ? inend - windowstart : ZOPFLI_WINDOW_SIZE;
+  T* disttable = (T*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(T));
+  if (!disttable){
+    exit(1);
+  }
+  GetCostTables(costcontext, literals, litlentable, disttable, distend);
 
   size_t blocksize = inend - instart;
 
-  float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
+  T* costs = (T*)malloc(sizeof(T) * (blocksize + 1));
   if (!costs) exit(1); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
-  memset(costs + 1, 127, sizeof(float) * blocksize);
+  memset(costs + 1, 127, sizeof(T) * blocksize);
 
   unsigned notenoughsame = instart + ZOPFLI_MAX_MATCH;
   for (i = instart; i < inend; i++) {
@@ -296,7 +392,7 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
           > ZOPFLI_MAX_MATCH) {
         unsigned match = same - ZOPFLI_MAX_MATCH;
 
-        float symbolcost = costcontext->ll_symbols[285] + costcontext->d_symbols[0];
+        T symbolcost = ScaleCost<T>(costcontext->ll_symbols[285] + costcontext->d_symbols[0]);
         /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to
          the cost corresponding to that length. Doing this, we skip
          ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */
@@ -341,17 +437,17 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
       }
 #endif
       else{
-        float price = costs[j];
+        T price = costs[j];
         unsigned short* mp = matches;
 
         unsigned curr = ZOPFLI_MIN_MATCH;
         while (mp < mend){
           unsigned len = *mp++;
           unsigned dist = *mp++;
-          float price2 = price + disttable[dist];
+          T price2 = price + disttable[dist];
           dist <<=9;
           for (; curr <= len; curr++) {
-            float x = price2 + litlentable[curr];
+            T x = price2 + litlentable[curr];
             if (x < costs[j + curr]){
               costs[j + curr] = x;
               length_array[j + curr] = curr + dist;
@@ -362,7 +458,7 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
     }
 
     /* Literal. */
-    float newCost = costs[j] + literals[in[i]];
+    T newCost = costs[j] + literals[in[i]];
     if (newCost < costs[j + 1]) {
       costs[j + 1] = newCost;
       length_array[j + 1] = 1 + (in[i] << 24);
@@ -375,118 +471,28 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
   free(costs);
 }
 
+template<typename T>
 static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend,
-                           SymbolStats* costcontext, unsigned* length_array, unsigned char storeincache, LZCache* c, unsigned mfinexport) {
+                           const SymbolStats* costcontext, unsigned* length_array, unsigned char storeincache, LZCache* c, unsigned mfinexport) {
   size_t i;
 
-  /*TODO: Put this in seperate function*/
-  float litlentable [259];
-  float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
-  float* literals;
+  T literals[256];
+  T litlentable[259];
+  /* No match can reach back further than windowstart. */
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  size_t distend = inend - windowstart < ZOPFLI_WINDOW_SIZE ? inend - windowstart : ZOPFLI_WINDOW_SIZE;
+  T* disttable = (T*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(T));
   if (!disttable){
     exit(1);
   }
-  if (costcontext){  /* Dynamic Block */
-
-    literals = costcontext->ll_symbols;
-    for (i = 3; i < 259; i++){
-      litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 0; i < 513; i++){
-      disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
-    }
-    float counter = costcontext->d_symbols[18] + 8;
-    for (; i < 769; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[19] + 8;
-    for (; i < 1025; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[20] + 9;
-    for (; i < 1537; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[21] + 9;
-    for (; i < 2049; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[22] + 10;
-    for (; i < 3073; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[23] + 10;
-    for (; i < 4097; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[24] + 11;
-    for (; i < 6145; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[25] + 11;
-    for (; i < 8193; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[26] + 12;
-    for (; i < 12289; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[27] + 12;
-    for (; i < 16385; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[28] + 13;
-    for (; i < 24577; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[29] + 13;
-    for (; i < 32768; i++){
-      disttable[i] = counter;
-    }
-  }
-  else {
-    literals = (float*)malloc(256 * sizeof(float));
-    if (!literals){
-      exit(1);
-    }
-
-    for (i = 0; i < 144; i++){
-      literals[i] = 8;
-    }
-    for (; i < 256; i++){
-      literals[i] = 9;
-    }
-    for (i = 3; i < 259; i++){
-      litlentable[i] = 12 + (i > 114) + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 0; i < 1025; i++){
-      disttable[i] = ZopfliGetDistExtraBits(i);
-    }
-    for (; i < 2049; i++){
-      disttable[i] = 9;
-    }
-    for (; i < 4097; i++){
-      disttable[i] = 10;
-    }
-    for (; i < 8193; i++){
-      disttable[i] = 11;
-    }
-    for (; i < 16385; i++){
-      disttable[i] = 12;
-    }
-    for (; i < 32768; i++){
-      disttable[i] = 13;
-    }
-  }
+  GetCostTables(costcontext, literals, litlentable, disttable, distend);
 
   size_t blocksize = inend - instart;
 
-  float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
+  T* costs = (T*)malloc(sizeof(T) * (blocksize + 1));
   if (!costs) exit(1); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
-  memset(costs + 1, 127, sizeof(float) * blocksize);
-
-  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  memset(costs + 1, 127, sizeof(T) * blocksize);
 
   CMatchFinder p;
   p.hash = 0;
@@ -509,7 +515,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
 
   unsigned short* matches;
   if (!storeincache){
-    matches = alloca(513 * sizeof(unsigned short));
+    matches = (unsigned short*)alloca(513 * sizeof(unsigned short));
   }
 
   unsigned notenoughsame = instart + ZOPFLI_MAX_MATCH;
@@ -527,7 +533,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
           > ZOPFLI_MAX_MATCH) {
         unsigned match = same - ZOPFLI_MAX_MATCH;
 
-        float symbolcost = costcontext ? costcontext->ll_symbols[285] + costcontext->d_symbols[0] : 13;
+        T symbolcost = ScaleCost<T>(costcontext ? costcontext->ll_symbols[285] + costcontext->d_symbols[0] : 13);
         /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to
          the cost corresponding to that length. Doing this, we skip
          ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */
@@ -567,7 +573,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
     else{
         if (c->size < c->pointer + (ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 2 + 1){
           c->size *= 2;
-          c->cache = realloc(c->cache, c->size * sizeof(unsigned short));
+          c->cache = (unsigned short*)realloc(c->cache, c->size * sizeof(unsigned short));
         }
         matches = c->cache + c->pointer + 1;
         numPairs = Bt3Zip_MatchFinder_GetMatches(&p, matches);
@@ -591,17 +597,17 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
       }
 #endif
       else{
-        float price = costs[j];
+        T price = costs[j];
         unsigned short* mp = matches;
 
         unsigned curr = ZOPFLI_MIN_MATCH;
         while (mp < mend){
           unsigned len = *mp++;
           unsigned dist = *mp++;
-          float price2 = price + disttable[dist];
+          T price2 = price + disttable[dist];
           dist <<=9;
           for (; curr <= len; curr++) {
-            float x = price2 + litlentable[curr];
+            T x = price2 + litlentable[curr];
             if (x < costs[j + curr]){
               costs[j + curr] = x;
               length_array[j + curr] = curr + dist;
@@ -612,7 +618,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
     }
 
     /* Literal. */
-    float newCost = costs[j] + literals[in[i]];
+    T newCost = costs[j] + literals[in[i]];
     if (newCost < costs[j + 1]) {
       costs[j + 1] = newCost;
       length_array[j + 1] = 1 + (in[i] << 24);
@@ -629,9 +635,6 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
     c->pointer = 0;
   }
 
-  if (!costcontext){
-    free(literals);
-  }
   free(disttable);
   free(costs);
 }
@@ -640,6 +643,8 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
   size_t i;
 
   unsigned char litlentable [259];
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  size_t distend = inend - windowstart < ZOPFLI_WINDOW_SIZE ? inend - windowstart : ZOPFLI_WINDOW_SIZE;
   unsigned char* disttable = (unsigned char*)malloc(ZOPFLI_WINDOW_SIZE);
   if (!disttable){
     exit(1);
@@ -648,7 +653,7 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
   for (i = 3; i < 259; i++){
     litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
   }
-  for (i = 0; i < 32768; i++){
+  for (i = 0; i < distend; i++){
     disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
   }
 
@@ -659,8 +664,6 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
 
-  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
-
   LZ3HC_Data_Structure h3;
   LZ4HC_init3(&h3, &in[windowstart]);
 
@@ -819,7 +822,7 @@ static void ZopfliCalculateEntropy(const size_t* count, size_t n, float* bitleng
 }
 
 /* Calculates the entropy of the statistics */
-static void CalculateStatistics(SymbolStats* stats) {
+void CalculateStatistics(SymbolStats* stats) {
   ZopfliCalculateEntropy(stats->litlens, 288, stats->ll_symbols);
   ZopfliCalculateEntropy(stats->dists, 32, stats->d_symbols);
 }
@@ -847,16 +850,44 @@ store: place to output the LZ77 data
 returns the cost that was, according to the costmodel, needed to get to the end.
     This is not the actual cost.
 */
+/*
+Integer costs can be used as long as the cost of the literal only path through
+the block stays below the sentinel the costs array is initialized with.
+*/
+static int FixedCostFits(const SymbolStats* costcontext, size_t blocksize) {
+  float maxcost = 9;
+  if (costcontext){
+    for (unsigned i = 0; i < 256; i++){
+      if (costcontext->ll_symbols[i] > maxcost){
+        maxcost = costcontext->ll_symbols[i];
+      }
+    }
+  }
+  return ((double)maxcost * COST_SCALE + 1) * blocksize + 65536 < 0x7F7F7F7F;
+}
+
 static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, unsigned* length_array, void* costcontext, ZopfliLZ77Store* store, unsigned char storeincache, LZCache* c, unsigned mfinexport, unsigned ultra2) {
   if (ultra2) {
-    GetBestLengthsultra2(in, instart, inend, costcontext, length_array);
+    GetBestLengthsultra2(in, instart, inend, (iSymbolStats*)costcontext, length_array);
   }
   else{
+    const SymbolStats* stats = (const SymbolStats*)costcontext;
+    int fixedcost = options->fixedcost && FixedCostFits(stats, inend - instart);
     if(storeincache == 2){
-      GetBestLengths2(in, instart, inend, costcontext, length_array, c);
+      if (fixedcost){
+        GetBestLengths2<unsigned>(in, instart, inend, stats, length_array, c);
+      }
+      else{
+        GetBestLengths2<float>(in, instart, inend, stats, length_array, c);
+      }
     }
     else{
-        GetBestLengths(options, in, instart, inend, costcontext, length_array, storeincache, c, mfinexport);
+      if (fixedcost){
+        GetBestLengths<unsigned>(options, in, instart, inend, stats, length_array, storeincache, c, mfinexport);
+      }
+      else{
+        GetBestLengths<float>(options, in, instart, inend, stats, length_array, storeincache, c, mfinexport);
+      }
     }
   }
 
@@ -867,12 +898,10 @@ static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in
   free(path);
 }
 
-/*TODO: Replace this w/ proper implementation. This performs bad on files w/ changing redundancy */
-static thread_local SymbolStats st;
-
 static void ZopfliLZ77Optimal(const ZopfliOptions* options,
                        const unsigned char* in, size_t instart, size_t inend,
-                       ZopfliLZ77Store* store, unsigned char first, SymbolStats* statsp, unsigned mfinexport) {
+                       ZopfliLZ77Store* store, const SymbolStats* statsp,
+                       ZopfliCostModel* prev, ZopfliCostModel* self, unsigned mfinexport) {
   /* Dist to get to here with smallest cost. */
   unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
   ZopfliLZ77Store currentstore;
@@ -883,6 +912,9 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
   /* Try randomizing the costs a bit once the size stabilizes. */
   RanState ran_state;
   int lastrandomstep = -1;
+  /* Once randomizing, this many runs without improvement count as converged. */
+  int patience = options->numiterations / 4 > 10 ? options->numiterations / 4 : 10;
+  int lastimprove = 0;
 
   if (!length_array) exit(1); /* Allocation failed. */
 
@@ -892,16 +924,17 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
   /* Do regular deflate, then loop multiple shortest path runs, each time using
   the statistics of the previous run. */
 
-  /* Initial run. */
-  if (first || !options->reuse_costmodel){
-    SymbolStats fromBlocksplitting = *statsp;
-    CopyStats(&fromBlocksplitting, &stats);
+  /* Initial run, with the statistics from block splitting, mixed with the model
+  of the previous block if there is one. */
+  int warm = prev && WaitCostModel(prev, &stats);
+  if (!warm){
+    CopyStats(statsp, &stats);
   }
   else{
-    CopyStats(&st, &stats);
+    MixCostmodels(statsp, &stats, .5);
   }
 
-  if (options->isPNG && options->numiterations < 9){
+  if (options->isPNG && options->numiterations < 9 && !warm){
     /*TODO:Corrections for cost model inaccuracies. There is still much potential here
      Enable this in Mode 4 too, though less aggressive*/
     for (unsigned i = 0; i < 256; i++){
@@ -951,7 +984,6 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
   }
 
   LZCache c;
-  int stinit = 0;
   if (options->useCache){
     CreateCache(inend - instart, &c);
   }
@@ -988,6 +1020,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       ZopfliCopyLZ77Store(&currentstore, store);
       CopyStats(&stats, &beststats);
       bestcost = cost;
+      lastimprove = i;
     }
     else{
       gui = 1;
@@ -995,10 +1028,6 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
     CopyStats(&stats, &laststats);
     GetStatistics(&currentstore, &stats);
 
-    if (i == 4 && options->reuse_costmodel){
-      CopyStats(&beststats, &st);
-      stinit = 1;
-    }
     if (lastrandomstep) {
       /* This makes it converge slower but better. Do it only once the
       randomness kicks in so that if the user does few iterations, it gives a
@@ -1013,7 +1042,19 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       lastrandomstep = i;
     }
     lastcost = cost;
+    /* Publish early so the next block doesn't wait for all of this one. */
+    if (self && i == 4){
+      ZopfliPublishCostModel(self, &beststats);
+    }
     if(gui && options->numiterations < 6){break;}
+    /* Once converged, skip ahead to the second to last run, which restarts
+    from the best statistics. */
+    if (lastrandomstep > 0 && i - lastimprove >= patience && i < options->numiterations - 2){
+      i = options->numiterations - 2;
+    }
+  }
+  if (self){
+    ZopfliPublishCostModel(self, &beststats);
   }
 
   if (options->ultra){
@@ -1102,93 +1143,76 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
     CleanCache(&c);
   }
   free(length_array);
-  if (options->reuse_costmodel && !stinit){
-    CopyStats(&beststats, &st);
-  }
   ZopfliCleanLZ77Store(&currentstore);
 }
 
 void ZopfliLZ77Optimal2(const ZopfliOptions* options,
                         const unsigned char* in, size_t instart, size_t inend,
-                        ZopfliLZ77Store* store, unsigned char costmodelnotinited, SymbolStats* statsp, unsigned mfinexport) {
+                        ZopfliLZ77Store* store, const SymbolStats* statsp,
+                        ZopfliCostModel* prev, ZopfliCostModel* self, unsigned mfinexport) {
   SymbolStats stats;
   if (options->numiterations != 1){
-    ZopfliLZ77Optimal(options, in, instart, inend, store, costmodelnotinited, statsp, mfinexport);
+    ZopfliLZ77Optimal(options, in, instart, inend, store, statsp, prev, self, mfinexport);
     return;
   }
 
-  //TODO: Test this for PNG if last two cost models similar
-  if (costmodelnotinited || (!options->reuse_costmodel)){
-    SymbolStats fromBlocksplitting = *statsp;
-    CopyStats(&fromBlocksplitting, &stats);
+  CopyStats(statsp, &stats);
 
-    if (options->isPNG){
-      /*TODO:Corrections for cost model inaccuracies. There is still much potential here
-       Enable this in Mode 4 too, though less aggressive*/
+  if (options->isPNG){
+    /*TODO:Corrections for cost model inaccuracies. There is still much potential here
+     Enable this in Mode 4 too, though less aggressive*/
+    for (unsigned i = 0; i < 256; i++){
+      stats.ll_symbols[i] -= .2;
+    }
+    if (inend - instart < 1000){
       for (unsigned i = 0; i < 256; i++){
-        stats.ll_symbols[i] -= .2;
-      }
-      if (inend - instart < 1000){
-        for (unsigned i = 0; i < 256; i++){
-          stats.ll_symbols[i] -= 0.2;
-        }
-      }
-      stats.ll_symbols[0] -= 1.2;
-      stats.ll_symbols[1] -= 0.4;
-      stats.d_symbols[0] -= 1.5;
-      stats.d_symbols[3] -= 1.4;
-      stats.ll_symbols[255] -= 0.5;
-      stats.ll_symbols[257] -= .8;
-      stats.ll_symbols[258] += 0.3;
-      stats.ll_symbols[272] += 1.2;
-      stats.ll_symbols[282] += 0.2;
-      stats.ll_symbols[283] += 0.2;
-      stats.ll_symbols[284] += 0.4;
-      stats.ll_symbols[285] += 0.3;
-
-      for (unsigned i = 270; i < 286; i++){
-          stats.ll_symbols[i] += .35;
-      }
-      for (unsigned i = 0; i < 286; i++){
-        if (stats.ll_symbols[i] < 1){
-          stats.ll_symbols[i] = 1;
-        }
+        stats.ll_symbols[i] -= 0.2;
       }
-      for (unsigned i = 0; i < 30; i++){
-        if (stats.d_symbols[i] < 1){
-          stats.d_symbols[i] = 1;
-        }
+    }
+    stats.ll_symbols[0] -= 1.2;
+    stats.ll_symbols[1] -= 0.4;
+    stats.d_symbols[0] -= 1.5;
+    stats.d_symbols[3] -= 1.4;
+    stats.ll_symbols[255] -= 0.5;
+    stats.ll_symbols[257] -= .8;
+    stats.ll_symbols[258] += 0.3;
+    stats.ll_symbols[272] += 1.2;
+    stats.ll_symbols[282] += 0.2;
+    stats.ll_symbols[283] += 0.2;
+    stats.ll_symbols[284] += 0.4;
+    stats.ll_symbols[285] += 0.3;
+
+    for (unsigned i = 270; i < 286; i++){
+        stats.ll_symbols[i] += .35;
+    }
+    for (unsigned i = 0; i < 286; i++){
+      if (stats.ll_symbols[i] < 1){
+        stats.ll_symbols[i] = 1;
       }
-      for (unsigned i = 0; i < 286; i++){
-        if (stats.ll_symbols[i] > 15){
-          stats.ll_symbols[i] = 15;
-        }
+    }
+    for (unsigned i = 0; i < 30; i++){
+      if (stats.d_symbols[i] < 1){
+        stats.d_symbols[i] = 1;
       }
-      for (unsigned i = 0; i < 30; i++){
-        if (stats.d_symbols[i] > 15){
-          stats.d_symbols[i] = 15;
-        }
+    }
+    for (unsigned i = 0; i < 286; i++){
+      if (stats.ll_symbols[i] > 15){
+        stats.ll_symbols[i] = 15;
       }
     }
-    if (!costmodelnotinited && !options->multithreading){
-      MixCostmodels(&st, &stats, .2);
+    for (unsigned i = 0; i < 30; i++){
+      if (stats.d_symbols[i] > 15){
+        stats.d_symbols[i] = 15;
+      }
     }
   }
-  else{
-    SymbolStats fromBlocksplitting = *statsp;
-    MixCostmodels(&fromBlocksplitting, &st, .3);
-  }
 
   ZopfliInitLZ77Store(store);
   /* Dist to get to here with smallest cost. */
   unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
   if (!length_array) exit(1); /* Allocation failed. */
-  LZ77OptimalRun(options, in, instart, inend, length_array, options->reuse_costmodel ? &st : &stats, store, 0, 0, mfinexport, 0);
+  LZ77OptimalRun(options, in, instart, inend, length_array, &stats, store, 0, 0, mfinexport, 0);
   free(length_array);
-
-  if (!options->multithreading){
-    GetStatistics(store, &st);
-  }
 }
 
 void ZopfliLZ77OptimalFixed(const ZopfliOptions* options,
@@ -55,14 +55,34 @@ typedef struct SymbolStats {
   } iSymbolStats;
 
 void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats);
+/* Calculates the symbol lengths from the counts of stats. */
+void CalculateStatistics(SymbolStats* stats);
+
+/*
+Cost model handed from one block to the next of the same master block. The
+optimal parser publishes the model of its block after a few iterations and the
+next block starts from it, mixed with its block splitting statistics. The next
+block waits for it, so the result doesn't depend on the thread count.
+*/
+typedef struct ZopfliCostModel ZopfliCostModel;
+
+/* Returns NULL if blocks aren't chained with these options. */
+ZopfliCostModel* ZopfliAllocCostModels(const ZopfliOptions* options, size_t n);
+void ZopfliFreeCostModels(ZopfliCostModel* models);
+ZopfliCostModel* ZopfliCostModelAt(ZopfliCostModel* models, size_t i);
+
+/* Publishes stats, or no model if stats is NULL. Later calls are ignored. */
+void ZopfliPublishCostModel(ZopfliCostModel* model, const SymbolStats* stats);
 
 /*
 Calculates lit/len and dist pairs for given data.
 If instart is larger than 0, it uses values before instart as starting
 dictionary.
+prev: model to start from, or NULL. self: where to publish the model of this
+block, or NULL.
 */
 
-void ZopfliLZ77Optimal2(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, ZopfliLZ77Store* store, unsigned char first, SymbolStats* statsp, unsigned mfinexport);
+void ZopfliLZ77Optimal2(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, ZopfliLZ77Store* store, const SymbolStats* statsp, ZopfliCostModel* prev, ZopfliCostModel* self, unsigned mfinexport);
 
 /*
 Does the same as ZopfliLZ77Optimal, but optimized for the fixed tree of the
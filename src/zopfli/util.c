@@ -22,192 +22,130 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "util.h"
 #include "zopfli.h"
 
-unsigned ZopfliGetDistExtraBits(unsigned dist) {
-#ifdef __GNUC__
-  if (dist < 5) return 0;
-  return (31 ^ __builtin_clz(dist - 1)) - 1; /* log2(dist - 1) - 1 */
-#else
-  if (dist < 5) return 0;
-  else if (dist < 9) return 1;
-  else if (dist < 17) return 2;
-  else if (dist < 33) return 3;
-  else if (dist < 65) return 4;
-  else if (dist < 129) return 5;
-  else if (dist < 257) return 6;
-  else if (dist < 513) return 7;
-  else if (dist < 1025) return 8;
-  else if (dist < 2049) return 9;
-  else if (dist < 4097) return 10;
-  else if (dist < 8193) return 11;
-  else if (dist < 16385) return 12;
-  else return 13;
-#endif
-}
-
-unsigned ZopfliGetDistExtraBitsValue(unsigned dist) {
-#ifdef __GNUC__
-  if (dist < 5) {
-    return 0;
-  }
-  int l = 31 ^ __builtin_clz(dist - 1); /* log2(dist - 1) */
-  return (dist - (1 + (1 << l))) & ((1 << (l - 1)) - 1);
-#else
-  if (dist < 5) return 0;
-  else if (dist < 9) return (dist - 5) & 1;
-  else if (dist < 17) return (dist - 9) & 3;
-  else if (dist < 33) return (dist - 17) & 7;
-  else if (dist < 65) return (dist - 33) & 15;
-  else if (dist < 129) return (dist - 65) & 31;
-  else if (dist < 257) return (dist - 129) & 63;
-  else if (dist < 513) return (dist - 257) & 127;
-  else if (dist < 1025) return (dist - 513) & 255;
-  else if (dist < 2049) return (dist - 1025) & 511;
-  else if (dist < 4097) return (dist - 2049) & 1023;
-  else if (dist < 8193) return (dist - 4097) & 2047;
-  else if (dist < 16385) return (dist - 8193) & 4095;
-  else return (dist - 16385) & 8191;
-#endif
-}
-
-int ZopfliGetDistSymbol(int dist) {
-#ifdef __GNUC__
-  if (dist < 5) {
-    return dist - 1;
-  }
-  int l = (31 ^ __builtin_clz(dist - 1)); /* log2(dist - 1) */
-  int r = ((dist - 1) >> (l - 1)) & 1;
-  return l * 2 + r;
-#else
-  if (dist < 193) {
-    if (dist < 13) {  /* dist 0..13. */
-      if (dist < 5) return dist - 1;
-      else if (dist < 7) return 4;
-      else if (dist < 9) return 5;
-      else return 6;
-    } else {  /* dist 13..193. */
-      if (dist < 17) return 7;
-      else if (dist < 25) return 8;
-      else if (dist < 33) return 9;
-      else if (dist < 49) return 10;
-      else if (dist < 65) return 11;
-      else if (dist < 97) return 12;
-      else if (dist < 129) return 13;
-      else return 14;
-    }
-  } else {
-    if (dist < 2049) {  /* dist 193..2049. */
-      if (dist < 257) return 15;
-      else if (dist < 385) return 16;
-      else if (dist < 513) return 17;
-      else if (dist < 769) return 18;
-      else if (dist < 1025) return 19;
-      else if (dist < 1537) return 20;
-      else return 21;
-    } else {  /* dist 2049..32768. */
-      if (dist < 3073) return 22;
-      else if (dist < 4097) return 23;
-      else if (dist < 6145) return 24;
-      else if (dist < 8193) return 25;
-      else if (dist < 12289) return 26;
-      else if (dist < 16385) return 27;
-      else if (dist < 24577) return 28;
-      else return 29;
-    }
-  }
-#endif
-}
-
-unsigned ZopfliGetLengthExtraBits(unsigned l) {
-  static const unsigned table[259] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
-    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 0
-  };
-  return table[l];
-}
-
-unsigned ZopfliGetLengthExtraBitsValue(unsigned l) {
-  static const unsigned table[259] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 0,
-    1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5,
-    6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6,
-    7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
-    13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2,
-    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
-    10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28,
-    29, 30, 31, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
-    18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 0, 1, 2, 3, 4, 5, 6,
-    7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26,
-    27, 28, 29, 30, 31, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 0
-  };
-  return table[l];
-}
+const ZopfliLengthCode ZopfliLengthCodes[259] = {
+  {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {257, 0, 0}, {258, 0, 0}, {259, 0, 0},
+  {260, 0, 0}, {261, 0, 0}, {262, 0, 0}, {263, 0, 0}, {264, 0, 0}, {265, 1, 0},
+  {265, 1, 1}, {266, 1, 0}, {266, 1, 1}, {267, 1, 0}, {267, 1, 1}, {268, 1, 0},
+  {268, 1, 1}, {269, 2, 0}, {269, 2, 1}, {269, 2, 2}, {269, 2, 3}, {270, 2, 0},
+  {270, 2, 1}, {270, 2, 2}, {270, 2, 3}, {271, 2, 0}, {271, 2, 1}, {271, 2, 2},
+  {271, 2, 3}, {272, 2, 0}, {272, 2, 1}, {272, 2, 2}, {272, 2, 3}, {273, 3, 0},
+  {273, 3, 1}, {273, 3, 2}, {273, 3, 3}, {273, 3, 4}, {273, 3, 5}, {273, 3, 6},
+  {273, 3, 7}, {274, 3, 0}, {274, 3, 1}, {274, 3, 2}, {274, 3, 3}, {274, 3, 4},
+  {274, 3, 5}, {274, 3, 6}, {274, 3, 7}, {275, 3, 0}, {275, 3, 1}, {275, 3, 2},
+  {275, 3, 3}, {275, 3, 4}, {275, 3, 5}, {275, 3, 6}, {275, 3, 7}, {276, 3, 0},
+  {276, 3, 1}, {276, 3, 2}, {276, 3, 3}, {276, 3, 4}, {276, 3, 5}, {276, 3, 6},
+  {276, 3, 7}, {277, 4, 0}, {277, 4, 1}, {277, 4, 2}, {277, 4, 3}, {277, 4, 4},
+  {277, 4, 5}, {277, 4, 6}, {277, 4, 7}, {277, 4, 8}, {277, 4, 9}, {277, 4, 10},
+  {277, 4, 11}, {277, 4, 12}, {277, 4, 13}, {277, 4, 14}, {277, 4, 15}, {278, 4, 0},
+  {278, 4, 1}, {278, 4, 2}, {278, 4, 3}, {278, 4, 4}, {278, 4, 5}, {278, 4, 6},
+  {278, 4, 7}, {278, 4, 8}, {278, 4, 9}, {278, 4, 10}, {278, 4, 11}, {278, 4, 12},
+  {278, 4, 13}, {278, 4, 14}, {278, 4, 15}, {279, 4, 0}, {279, 4, 1}, {279, 4, 2},
+  {279, 4, 3}, {279, 4, 4}, {279, 4, 5}, {279, 4, 6}, {279, 4, 7}, {279, 4, 8},
+  {279, 4, 9}, {279, 4, 10}, {279, 4, 11}, {279, 4, 12}, {279, 4, 13}, {279, 4, 14},
+  {279, 4, 15}, {280, 4, 0}, {280, 4, 1}, {280, 4, 2}, {280, 4, 3}, {280, 4, 4},
+  {280, 4, 5}, {280, 4, 6}, {280, 4, 7}, {280, 4, 8}, {280, 4, 9}, {280, 4, 10},
+  {280, 4, 11}, {280, 4, 12}, {280, 4, 13}, {280, 4, 14}, {280, 4, 15}, {281, 5, 0},
+  {281, 5, 1}, {281, 5, 2}, {281, 5, 3}, {281, 5, 4}, {281, 5, 5}, {281, 5, 6},
+  {281, 5, 7}, {281, 5, 8}, {281, 5, 9}, {281, 5, 10}, {281, 5, 11}, {281, 5, 12},
+  {281, 5, 13}, {281, 5, 14}, {281, 5, 15}, {281, 5, 16}, {281, 5, 17}, {281, 5, 18},
+  {281, 5, 19}, {281, 5, 20}, {281, 5, 21}, {281, 5, 22}, {281, 5, 23}, {281, 5, 24},
+  {281, 5, 25}, {281, 5, 26}, {281, 5, 27}, {281, 5, 28}, {281, 5, 29}, {281, 5, 30},
+  {281, 5, 31}, {282, 5, 0}, {282, 5, 1}, {282, 5, 2}, {282, 5, 3}, {282, 5, 4},
+  {282, 5, 5}, {282, 5, 6}, {282, 5, 7}, {282, 5, 8}, {282, 5, 9}, {282, 5, 10},
+  {282, 5, 11}, {282, 5, 12}, {282, 5, 13}, {282, 5, 14}, {282, 5, 15}, {282, 5, 16},
+  {282, 5, 17}, {282, 5, 18}, {282, 5, 19}, {282, 5, 20}, {282, 5, 21}, {282, 5, 22},
+  {282, 5, 23}, {282, 5, 24}, {282, 5, 25}, {282, 5, 26}, {282, 5, 27}, {282, 5, 28},
+  {282, 5, 29}, {282, 5, 30}, {282, 5, 31}, {283, 5, 0}, {283, 5, 1}, {283, 5, 2},
+  {283, 5, 3}, {283, 5, 4}, {283, 5, 5}, {283, 5, 6}, {283, 5, 7}, {283, 5, 8},
+  {283, 5, 9}, {283, 5, 10}, {283, 5, 11}, {283, 5, 12}, {283, 5, 13}, {283, 5, 14},
+  {283, 5, 15}, {283, 5, 16}, {283, 5, 17}, {283, 5, 18}, {283, 5, 19}, {283, 5, 20},
+  {283, 5, 21}, {283, 5, 22}, {283, 5, 23}, {283, 5, 24}, {283, 5, 25}, {283, 5, 26},
+  {283, 5, 27}, {283, 5, 28}, {283, 5, 29}, {283, 5, 30}, {283, 5, 31}, {284, 5, 0},
+  {284, 5, 1}, {284, 5, 2}, {284, 5, 3}, {284, 5, 4}, {284, 5, 5}, {284, 5, 6},
+  {284, 5, 7}, {284, 5, 8}, {284, 5, 9}, {284, 5, 10}, {284, 5, 11}, {284, 5, 12},
+  {284, 5, 13}, {284, 5, 14}, {284, 5, 15}, {284, 5, 16}, {284, 5, 17}, {284, 5, 18},
+  {284, 5, 19}, {284, 5, 20}, {284, 5, 21}, {284, 5, 22}, {284, 5, 23}, {284, 5, 24},
+  {284, 5, 25}, {284, 5, 26}, {284, 5, 27}, {284, 5, 28}, {284, 5, 29}, {284, 5, 30},
+  {285, 0, 0}
+};
 
-/*
-Returns symbol in range [257-285] (inclusive).
-*/
-unsigned ZopfliGetLengthSymbol(unsigned l) {
-  static const unsigned table[259] = {
-    0, 0, 0, 257, 258, 259, 260, 261, 262, 263, 264,
-    265, 265, 266, 266, 267, 267, 268, 268,
-    269, 269, 269, 269, 270, 270, 270, 270,
-    271, 271, 271, 271, 272, 272, 272, 272,
-    273, 273, 273, 273, 273, 273, 273, 273,
-    274, 274, 274, 274, 274, 274, 274, 274,
-    275, 275, 275, 275, 275, 275, 275, 275,
-    276, 276, 276, 276, 276, 276, 276, 276,
-    277, 277, 277, 277, 277, 277, 277, 277,
-    277, 277, 277, 277, 277, 277, 277, 277,
-    278, 278, 278, 278, 278, 278, 278, 278,
-    278, 278, 278, 278, 278, 278, 278, 278,
-    279, 279, 279, 279, 279, 279, 279, 279,
-    279, 279, 279, 279, 279, 279, 279, 279,
-    280, 280, 280, 280, 280, 280, 280, 280,
-    280, 280, 280, 280, 280, 280, 280, 280,
-    281, 281, 281, 281, 281, 281, 281, 281,
-    281, 281, 281, 281, 281, 281, 281, 281,
-    281, 281, 281, 281, 281, 281, 281, 281,
-    281, 281, 281, 281, 281, 281, 281, 281,
-    282, 282, 282, 282, 282, 282, 282, 282,
-    282, 282, 282, 282, 282, 282, 282, 282,
-    282, 282, 282, 282, 282, 282, 282, 282,
-    282, 282, 282, 282, 282, 282, 282, 282,
-    283, 283, 283, 283, 283, 283, 283, 283,
-    283, 283, 283, 283, 283, 283, 283, 283,
-    283, 283, 283, 283, 283, 283, 283, 283,
-    283, 283, 283, 283, 283, 283, 283, 283,
-    284, 284, 284, 284, 284, 284, 284, 284,
-    284, 284, 284, 284, 284, 284, 284, 284,
-    284, 284, 284, 284, 284, 284, 284, 284,
-    284, 284, 284, 284, 284, 284, 284, 285
-  };
-  return table[l];
-}
+const ZopfliDistCode ZopfliDistCodes[512] = {
+  {-1, 0}, {0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 1}, {4, 1}, {5, 1},
+  {5, 1}, {6, 2}, {6, 2}, {6, 2}, {6, 2}, {7, 2}, {7, 2}, {7, 2},
+  {7, 2}, {8, 3}, {8, 3}, {8, 3}, {8, 3}, {8, 3}, {8, 3}, {8, 3},
+  {8, 3}, {9, 3}, {9, 3}, {9, 3}, {9, 3}, {9, 3}, {9, 3}, {9, 3},
+  {9, 3}, {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4},
+  {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4}, {10, 4},
+  {10, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4},
+  {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4}, {11, 4},
+  {11, 4}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5},
+  {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5},
+  {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5},
+  {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5}, {12, 5},
+  {12, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5},
+  {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5},
+  {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5},
+  {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5}, {13, 5},
+  {13, 5}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6}, {14, 6},
+  {14, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6}, {15, 6},
+  {15, 6}, {0, 0}, {16, 7}, {17, 7}, {18, 8}, {18, 8}, {19, 8}, {19, 8},
+  {20, 9}, {20, 9}, {20, 9}, {20, 9}, {21, 9}, {21, 9}, {21, 9}, {21, 9},
+  {22, 10}, {22, 10}, {22, 10}, {22, 10}, {22, 10}, {22, 10}, {22, 10}, {22, 10},
+  {23, 10}, {23, 10}, {23, 10}, {23, 10}, {23, 10}, {23, 10}, {23, 10}, {23, 10},
+  {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11},
+  {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11}, {24, 11},
+  {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11},
+  {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11}, {25, 11},
+  {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12},
+  {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12},
+  {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12},
+  {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12}, {26, 12},
+  {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12},
+  {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12},
+  {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12},
+  {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12}, {27, 12},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13}, {28, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13},
+  {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}, {29, 13}
+};
 
 static const ZopfliOptionsMin opt[8] =
 {
-  { 1, 0, 0, 2000,    0, 180,  800}, /* 2 */
-  { 1, 1, 0, 2000,    0, 180,  512}, /* 3 */
-  { 2, 1, 0, 2000,    0, 180,  512}, /* 4 */
-  { 3, 1, 1, 2000,    0, 180,  200}, /* 5 */
-  { 8, 1, 1, 1300,  800,  80,  200}, /* 6 */
-  {13, 1, 1, 1000, 1800,  80,  200}, /* 7 */
-  {60, 1, 2,  800, 2000,  80,  120}, /* 8 */
-  {60, 2, 3,  800, 3000,  80,  100}  /* 9 */
+  { 1, 0, 0, 2000,    0, 180,  800, 1}, /* 2 */
+  { 1, 1, 0, 2000,    0, 180,  512, 1}, /* 3 */
+  { 2, 1, 0, 2000,    0, 180,  512, 1}, /* 4 */
+  { 3, 1, 1, 2000,    0, 180,  200, 1}, /* 5 */
+  { 8, 1, 1, 1300,  800,  80,  200, 0}, /* 6 */
+  {13, 1, 1, 1000, 1800,  80,  200, 0}, /* 7 */
+  {60, 1, 2,  800, 2000,  80,  120, 0}, /* 8 */
+  {60, 2, 3,  800, 3000,  80,  100, 0}  /* 9 */
 };
 
 void ZopfliInitOptions(ZopfliOptions* options, unsigned _mode, unsigned multithreading, unsigned isPNG) {
@@ -234,10 +172,16 @@ void ZopfliInitOptions(ZopfliOptions* options, unsigned _mode, unsigned multithr
   options->replaceCodes = 1000 * (mode > 2) + 1;
   options->multithreading = multithreading;
   options->isPNG = isPNG;
-  options->reuse_costmodel = (!isPNG || mode > 6) && multithreading < 2;
   options->useCache = 1;
   options->ultra = (mode >= 5) + (options->numiterations > 60) + (options->numiterations > 90);
   options->entropysplit = mode < 3;
   options->greed = isPNG ? mode > 3 ? 258 : 50 : 258;
   options->advanced = mode >= 5;
+  options->fixedcost = min.fixedcost;
+  options->storethreshold = isPNG ? 0 : mode < 6 ? 3 : 1;
+  options->fast = _mode % 10000 == 1 && !isPNG;
+  options->chunksize = 0;
+  options->checkpoint = 0;
+  options->flush = 0;
+  options->flushopaque = 0;
 }
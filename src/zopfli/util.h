@@ -65,26 +65,63 @@ Used to initialize costs for example
 */
 #define ZOPFLI_LARGE_FLOAT 1e30
 
+/* Symbol, amount of extra bits and value of the extra bits of each length. */
+typedef struct ZopfliLengthCode {
+  unsigned short symbol;
+  unsigned char bits;
+  unsigned char value;
+} ZopfliLengthCode;
+
+extern const ZopfliLengthCode ZopfliLengthCodes[259];
+
+/*
+Symbol and amount of extra bits of each dist, indexed by the dist up to 256 and
+by 256 + ((dist - 1) >> 7) above, like zlib's _dist_code. The value of the extra
+bits are the low bits of dist - 1. Dist 0 has symbol -1.
+*/
+typedef struct ZopfliDistCode {
+  signed char symbol;
+  unsigned char bits;
+} ZopfliDistCode;
+
+extern const ZopfliDistCode ZopfliDistCodes[512];
+
+static inline const ZopfliDistCode* ZopfliGetDistCode(unsigned dist) {
+  return &ZopfliDistCodes[dist <= 256 ? dist : 256 + ((dist - 1) >> 7)];
+}
+
 /*
 Gets the symbol for the given length, cfr. the DEFLATE spec.
 Returns the symbol in the range [257-285] (inclusive)
 */
-unsigned ZopfliGetLengthSymbol(unsigned l);
+static inline unsigned ZopfliGetLengthSymbol(unsigned l) {
+  return ZopfliLengthCodes[l].symbol;
+}
 
 /* Gets the amount of extra bits for the given length, cfr. the DEFLATE spec. */
-unsigned ZopfliGetLengthExtraBits(unsigned l);
+static inline unsigned ZopfliGetLengthExtraBits(unsigned l) {
+  return ZopfliLengthCodes[l].bits;
+}
 
 /* Gets value of the extra bits for the given length, cfr. the DEFLATE spec. */
-unsigned ZopfliGetLengthExtraBitsValue(unsigned l);
+static inline unsigned ZopfliGetLengthExtraBitsValue(unsigned l) {
+  return ZopfliLengthCodes[l].value;
+}
 
 /* Gets the symbol for the given dist, cfr. the DEFLATE spec. */
-int ZopfliGetDistSymbol(int dist);
+static inline int ZopfliGetDistSymbol(int dist) {
+  return ZopfliGetDistCode(dist)->symbol;
+}
 
 /* Gets the amount of extra bits for the given dist, cfr. the DEFLATE spec. */
-unsigned ZopfliGetDistExtraBits(unsigned dist);
+static inline unsigned ZopfliGetDistExtraBits(unsigned dist) {
+  return ZopfliGetDistCode(dist)->bits;
+}
 
 /* Gets value of the extra bits for the given dist, cfr. the DEFLATE spec. */
-unsigned ZopfliGetDistExtraBitsValue(unsigned dist);
+static inline unsigned ZopfliGetDistExtraBitsValue(unsigned dist) {
+  return (dist - 1) & ((1u << ZopfliGetDistCode(dist)->bits) - 1);
+}
 
 #ifdef __GNUC__
 #define likely(x)      __builtin_expect(!!(x), 1)
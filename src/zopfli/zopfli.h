@@ -66,8 +66,6 @@ typedef struct ZopfliOptions {
    */
   unsigned searchext;
 
-  unsigned reuse_costmodel;
-
   /*When using more than one iteration, this will save the found matches on the first run so they don't need to be found again. Uses large amounts of memory.*/
   unsigned useCache;
 
@@ -94,6 +92,25 @@ typedef struct ZopfliOptions {
 
   /*Use advanced huffman and header optimizations.*/
   unsigned advanced;
+
+  /*Use integer costs in 1/16 bits instead of float costs in the optimal parser.*/
+  unsigned fixedcost;
+
+  /*Store master blocks whose predicted gain is below this many permille. 0 disables the check.*/
+  unsigned storethreshold;
+
+  /*Use lazy matching and one huffman tree per block instead of the optimal parser.*/
+  unsigned fast;
+
+  /*With multithreading, compress chunks of this many bytes in parallel. Each chunk only uses the end of the previous one as dictionary and ends byte aligned. 0 disables chunks. Checkpoints are not used in chunked mode. Must be the last member that affects the output, checkpoints hash the options up to here.*/
+  unsigned chunksize;
+
+  /*Directory to save progress to after every master block, so an interrupted run can resume. 0 disables checkpoints.*/
+  const char* checkpoint;
+
+  /*Called with the finished bytes of the output buffer after every master block, which are then removed from it. 0 keeps all output in the buffer. Not used with checkpoints.*/
+  void (*flush)(void* opaque, const unsigned char* data, size_t size);
+  void* flushopaque;
 } ZopfliOptions;
 
 typedef struct ZopfliOptionsMin {
@@ -104,6 +121,7 @@ typedef struct ZopfliOptionsMin {
   unsigned trystatic;
   unsigned skipdynamic;
   unsigned noblocksplitlz;
+  unsigned fixedcost;
 } ZopfliOptionsMin;
 /* Initializes options with default values. */
 void ZopfliInitOptions(ZopfliOptions* options, unsigned mode, unsigned multithreading, unsigned isPNG);
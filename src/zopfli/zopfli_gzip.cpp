@@ -19,36 +19,219 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 */
 
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "zopfli.h"
 #include "../zlib/zlib.h"
 #include "deflate.h"
+#include "util.h"
 #include "zopfli.h"
 #include "zlib_container.h"
 #include "../main.h"
 #include <time.h>
-
+#include <vector>
+#ifndef NOMULTI
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
+
+/* Unlike the one of util.h, doesn't grow the array, room is made in advance. */
+#undef ZOPFLI_APPEND_DATA
 #define ZOPFLI_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size) {\
 (*data)[(*size)] = (value);\
 (*size)++;\
 }
 
+/* Inputs of at least this size are read one master block at a time. */
+#define ZOPFLI_STREAM_SIZE 1073741824
+
+/*
+Destination of the compressed data. ZopfliDeflate hands finished master blocks
+to WriteOutput, so only the unfinished part is kept in the output buffer.
+*/
+typedef struct ZopfliOutput {
+  FILE* file;
+  unsigned long long written;  /* Bytes written to file so far. */
+} ZopfliOutput;
+
+/*
+Data to compress, either entirely in memory or read from file while
+compressing. crc and, when reading from file, size are set by DeflateInput.
+*/
+typedef struct ZopfliInput {
+  const unsigned char* data;  /* 0 to read from file or strm. */
+  FILE* file;
+  z_stream* strm;  /* If set, inflates the gzip members up to end instead of reading file. */
+  const unsigned char* end;
+  int next;  /* Byte read ahead from strm, or -1. */
+  unsigned long long size;
+  unsigned long crc;
+  int error;  /* Set if reading failed, the output is incomplete then. */
+} ZopfliInput;
+
+static void WriteOutput(void* opaque, const unsigned char* data, size_t size) {
+  ZopfliOutput* output = (ZopfliOutput*)opaque;
+  if (fwrite(data, 1, size, output->file) != size){
+    fprintf(stderr, "Can't write to file\n");
+    exit(1);
+  }
+  output->written += size;
+}
+
+/* Overwrites bytes bytes at pos of the output with value, little endian. */
+static void PatchOutput(ZopfliOutput* output, unsigned char* out, unsigned long long pos, unsigned long long value, unsigned bytes) {
+  unsigned char data[8];
+  for (unsigned i = 0; i < bytes; i++) data[i] = (value >> (i * 8)) % 256;
+  if (pos >= output->written){
+    memcpy(out + pos - output->written, data, bytes);
+    return;
+  }
+  fseek(output->file, pos, SEEK_SET);
+  fwrite(data, 1, bytes, output->file);
+  fseek(output->file, 0, SEEK_END);
+}
+
+/* CRC32 of data, in pieces that fit the length type of zlib. */
+static unsigned long Crc32(unsigned long crc, const unsigned char* data, unsigned long long size) {
+  while (size) {
+    unsigned n = size > 0x40000000 ? 0x40000000 : (unsigned)size;
+    crc = crc32(crc, data, n);
+    data += n;
+    size -= n;
+  }
+  return crc;
+}
+
+/* Reads up to size bytes of the input, returns the number of bytes read. */
+static size_t ReadInput(ZopfliInput* input, unsigned char* data, size_t size) {
+  if (!input->strm){
+    size_t n = fread(data, 1, size, input->file);
+    if (ferror(input->file)) input->error = 1;
+    return n;
+  }
+  size_t n = 0;
+  if (input->next >= 0 && size){
+    data[n++] = input->next;
+    input->next = -1;
+  }
+  z_stream* strm = input->strm;
+  while (n < size) {
+    if (!strm->avail_in){
+      size_t left = input->end - strm->next_in;
+      if (!left){
+        //total_in starts over with each member, so it is 0 unless one is cut off
+        if (strm->total_in) input->error = 1;
+        break;
+      }
+      strm->avail_in = left > 0x40000000 ? 0x40000000 : (unsigned)left;
+    }
+    strm->next_out = data + n;
+    strm->avail_out = size - n > 0x40000000 ? 0x40000000 : (unsigned)(size - n);
+    int ret = inflate(strm, Z_NO_FLUSH);
+    n = strm->next_out - data;
+    if (ret == Z_STREAM_END){
+      inflateReset(strm);
+    }
+    else if (ret != Z_OK){
+      input->error = 1;
+      break;
+    }
+  }
+  return n;
+}
+
+/* Whether the input has more bytes to read. */
+static int MoreInput(ZopfliInput* input) {
+  if (!input->strm){
+    int c = getc(input->file);
+    if (ferror(input->file)) input->error = 1;
+    if (c == EOF) return 0;
+    ungetc(c, input->file);
+    return 1;
+  }
+  unsigned char c;
+  if (input->next < 0 && ReadInput(input, &c, 1)){
+    input->next = c;
+  }
+  return input->next >= 0;
+}
+
+/*
+Reads and compresses the input one master block, or one chunk per thread, at a
+time. Only the current piece and the ZOPFLI_WINDOW_SIZE bytes before it are
+kept in memory. A read error sets input->error and ends the stream there.
+*/
+static void DeflateStream(const ZopfliOptions* options, ZopfliInput* input,
+                          unsigned char* bp, unsigned char** out, size_t* outsize) {
+  size_t msize = ZopfliStreamBlockSize(options);
+  unsigned char* window = (unsigned char*)malloc(ZOPFLI_WINDOW_SIZE + msize + 8);
+  if (!window){
+    exit(1);
+  }
+  size_t dict = 0;
+  input->size = 0;
+  size_t n = ReadInput(input, window, msize);
+  for (;;) {
+    int last = n < msize || input->error || !MoreInput(input);
+    input->crc = Crc32(input->crc, window + dict, n);
+    input->size += n;
+    memset(window + dict + n, 0, 8);
+    ZopfliDeflateMaster(options, last, window, dict, dict + n, bp, out, outsize);
+    if (last){
+      break;
+    }
+    size_t keep = dict + n < ZOPFLI_WINDOW_SIZE ? dict + n : ZOPFLI_WINDOW_SIZE;
+    memmove(window, window + dict + n - keep, keep);
+    dict = keep;
+    n = ReadInput(input, window + dict, msize);
+  }
+  free(window);
+}
+
+/* Appends the deflate stream of the input to out. */
+static void DeflateInput(const ZopfliOptions* options, ZopfliInput* input,
+                         unsigned char** out, size_t* outsize) {
+  unsigned char bp = 0;
+  input->crc = 0;
+  if (input->data){
+    input->crc = Crc32(0, input->data, input->size);
+    ZopfliDeflate(options, 1, input->data, input->size, &bp, out, outsize);
+  }
+  else{
+    DeflateStream(options, input, &bp, out, outsize);
+  }
+}
+
 static void ZopfliZipCompress(const ZopfliOptions* options,
-                              const unsigned char* in, size_t insize, time_t time, std::string name,
-                              unsigned char** out, size_t* outsize) {
+                              ZopfliInput* input, time_t time, std::string name,
+                              unsigned char** out, size_t* outsize, ZopfliOutput* output) {
   static const unsigned char filePKh[10]     = { 80, 75,  3,  4, 20,  0,  2,  0,  8,  0};
   static const unsigned char CDIRPKh[12]     = { 80, 75,  1,  2, 20,  0, 20,  0,  2,  0,  8,  0};
   static const unsigned char CDIRPKs[12]     = {  0,  0,  0,  0,  0,  0,  0,  0, 32,  0,  0,  0};
   static const unsigned char EndCDIRPKh[12]  = { 80, 75,  5,  6,  0,  0,  0,  0,  1,  0,  1,  0};
+  static const unsigned char Zip64EndPKh[4]  = { 80, 75,  6,  6};
+  static const unsigned char Zip64LocPKh[4]  = { 80, 75,  6,  7};
 
-  unsigned long crcvalue = crc32(0, in, insize);
   unsigned long i;
   std::string x = name.substr(name.find_last_of('/') + 1);
   const char* infilename = x.c_str();
-  unsigned char bp = 0;
   size_t max = x.size();
-  *out = (unsigned char*)realloc(*out, 200);
+  /* Sizes of 4 GiB or more need ZIP64 extra fields. Allow for some expansion of the deflate stream. */
+  int zip64 = input->size + input->size / 8 >= 0xFFFFFFFFULL;
+  unsigned extralen = zip64 ? 20 : 0;
+  unsigned char version = zip64 ? 45 : 20;
+  *out = (unsigned char*)realloc(*out, *outsize + 256 + max);
+  if (!*out){
+    exit(1);
+  }
 
   struct tm* times = localtime(&time);
   unsigned long dostime = times->tm_year < 80 ? 0x00210000 : times->tm_year > 207 ? 0xFF9FBF7D : (
@@ -58,38 +241,51 @@ static void ZopfliZipCompress(const ZopfliOptions* options,
 
   /* File PK STATIC DATA + CM */
 
-  for(i=0;i<sizeof(filePKh);++i) ZOPFLI_APPEND_DATA(filePKh[i],out,outsize);
+  for(i=0;i<sizeof(filePKh);++i) ZOPFLI_APPEND_DATA(i == 4 ? version : filePKh[i],out,outsize);
 
   /* MS-DOS TIME */
   for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((dostime >> (i*8)) % 256, out, outsize);
 
-  /* CRC */
-  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((crcvalue >> (i*8)) % 256, out, outsize);
-
-  /* OSIZE NOT KNOWN YET - WILL UPDATE AFTER COMPRESSION */
-  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(0, out, outsize);
-
-  /* ISIZE */
-  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((insize >> (i*8)) % 256, out, outsize);
+  /* CRC, OSIZE, ISIZE NOT KNOWN YET - WILL UPDATE AFTER COMPRESSION */
+  for(i=0;i<12;++i) ZOPFLI_APPEND_DATA(zip64 && i >= 4 ? 255 : 0, out, outsize);
 
   /* FNLENGTH */
   for(i=0;i<2;++i) ZOPFLI_APPEND_DATA((max >> (i*8)) % 256, out, outsize);
 
-  /* NO EXTRA FLAGS */
-  for(i=0;i<2;++i) ZOPFLI_APPEND_DATA(0, out, outsize);
+  /* EXTRA FIELD LENGTH */
+  for(i=0;i<2;++i) ZOPFLI_APPEND_DATA((extralen >> (i*8)) % 256, out, outsize);
 
   /* FILENAME */
   for(i=0;i<max;++i) ZOPFLI_APPEND_DATA(infilename[i], out, outsize);
-  unsigned long rawdeflsize = *outsize;
 
-  ZopfliDeflate(options, 1, in, insize, &bp, out, outsize);
-  *out = (unsigned char*)realloc(*out, 200 + *outsize);
+  /* ZIP64 EXTRA FIELD, ISIZE AND OSIZE WILL BE UPDATED */
+  for(i=0;i<extralen;++i) ZOPFLI_APPEND_DATA(i == 0 ? 1 : i == 2 ? 16 : 0, out, outsize);
+  unsigned long long rawdeflsize = output->written + *outsize;
 
-  rawdeflsize = *outsize - rawdeflsize;
+  DeflateInput(options, input, out, outsize);
+  *out = (unsigned char*)realloc(*out, *outsize + 256 + max);
+  if (!*out){
+    exit(1);
+  }
+
+  rawdeflsize = output->written + *outsize - rawdeflsize;
+  unsigned long long insize = input->size;
+  unsigned long crcvalue = input->crc;
+
+  /* UPDATE CRC, OSIZE, ISIZE IN PK HEADER */
+  PatchOutput(output, *out, 14, crcvalue, 4);
+  if (zip64){
+    PatchOutput(output, *out, 30 + max + 4, insize, 8);
+    PatchOutput(output, *out, 30 + max + 12, rawdeflsize, 8);
+  }
+  else{
+    PatchOutput(output, *out, 18, rawdeflsize, 4);
+    PatchOutput(output, *out, 22, insize, 4);
+  }
 
   /* C-DIR PK HEADER STATIC DATA */
-  unsigned long cdirsize = *outsize;
-  for(i=0;i<sizeof(CDIRPKh);++i) ZOPFLI_APPEND_DATA(CDIRPKh[i],out,outsize);
+  unsigned long long cdirsize = *outsize;
+  for(i=0;i<sizeof(CDIRPKh);++i) ZOPFLI_APPEND_DATA(i == 4 || i == 6 ? version : CDIRPKh[i],out,outsize);
 
   /* MS-DOS TIME, CRC, OSIZE, ISIZE FROM */
 
@@ -98,27 +294,51 @@ static void ZopfliZipCompress(const ZopfliOptions* options,
   /* CRC */
   for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((crcvalue >> (i*8)) % 256,out,outsize);
 
-  /* OSIZE + UPDATE IN PK HEADER */
-  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((rawdeflsize >> (i*8)) % 256,out,outsize);
-  for(i=0;i<4;++i) (*out)[18+i]=(rawdeflsize >> (i*8)) % 256;
+  /* OSIZE */
+  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(zip64 ? 255 : (rawdeflsize >> (i*8)) % 256,out,outsize);
 
   /* ISIZE */
-  for(i=0;i<25;i+=8) ZOPFLI_APPEND_DATA((insize >> i) % 256,out,outsize);
+  for(i=0;i<25;i+=8) ZOPFLI_APPEND_DATA(zip64 ? 255 : (insize >> i) % 256,out,outsize);
 
   /* FILENAME LENGTH */
   for(i=0;i<2;++i) ZOPFLI_APPEND_DATA((max >> (i*8)) % 256,out,outsize);
 
   /* C-DIR STATIC DATA */
-  for(i=0;i<sizeof(CDIRPKs);++i) ZOPFLI_APPEND_DATA(CDIRPKs[i],out,outsize);
+  for(i=0;i<sizeof(CDIRPKs);++i) ZOPFLI_APPEND_DATA(i == 0 ? extralen : CDIRPKs[i],out,outsize);
 
   /* FilePK offset in ZIP file */
   for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(0,out,outsize);
-  unsigned long cdiroffset= rawdeflsize + 30 + max;
+  unsigned long long cdiroffset = rawdeflsize + 30 + max + extralen;
 
   /* FILENAME */
   for(i=0; i<max;++i) ZOPFLI_APPEND_DATA(infilename[i],out,outsize);
+
+  /* ZIP64 EXTRA FIELD */
+  if (zip64){
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(i == 0 ? 1 : i == 2 ? 16 : 0,out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA((insize >> (i*8)) % 256,out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA((rawdeflsize >> (i*8)) % 256,out,outsize);
+  }
   cdirsize = *outsize - cdirsize;
 
+  if (zip64){
+    /* ZIP64 END C-DIR: RECORD SIZE, VERSIONS, DISKS, TOTAL FILES (ALWAYS 1) */
+    unsigned long long endoffset = cdiroffset + cdirsize;
+    for(i=0;i<sizeof(Zip64EndPKh);++i) ZOPFLI_APPEND_DATA(Zip64EndPKh[i],out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA(i == 0 ? 44 : 0,out,outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(i % 2 ? 0 : version,out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA(0,out,outsize);
+    for(i=0;i<16;++i) ZOPFLI_APPEND_DATA(i % 8 ? 0 : 1,out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA((cdirsize >> (i*8)) % 256,out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA((cdiroffset >> (i*8)) % 256,out,outsize);
+
+    /* ZIP64 END C-DIR LOCATOR */
+    for(i=0;i<sizeof(Zip64LocPKh);++i) ZOPFLI_APPEND_DATA(Zip64LocPKh[i],out,outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(0,out,outsize);
+    for(i=0;i<8;++i) ZOPFLI_APPEND_DATA((endoffset >> (i*8)) % 256,out,outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(i == 0 ? 1 : 0,out,outsize);
+  }
+
   /* END C-DIR PK STATIC DATA + TOTAL FILES (ALWAYS 1) */
   for(i=0;i<sizeof(EndCDIRPKh);++i) ZOPFLI_APPEND_DATA(EndCDIRPKh[i],out,outsize);
 
@@ -126,7 +346,7 @@ static void ZopfliZipCompress(const ZopfliOptions* options,
   for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((cdirsize >> (i*8)) % 256,out, outsize);
 
   /* C-DIR OFFSET */
-  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((cdiroffset >> (i*8)) % 256,out, outsize);
+  for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(cdiroffset >= 0xFFFFFFFFULL ? 255 : (cdiroffset >> (i*8)) % 256,out, outsize);
 
   /* NO COMMENTS IN END C-DIR */
   for(i=0;i<2;++i) ZOPFLI_APPEND_DATA(0, out, outsize);
@@ -136,11 +356,8 @@ static void ZopfliZipCompress(const ZopfliOptions* options,
 Compresses the data according to the gzip specification.
 */
 static void ZopfliGzipCompress(const ZopfliOptions* options,
-                        const unsigned char* in, size_t insize, time_t time,
+                        ZopfliInput* input, time_t time,
                         unsigned char** out, size_t* outsize) {
-  unsigned crcvalue = crc32(0, in, insize);
-  unsigned char bp = 0;
-
   (*out) = (unsigned char*)malloc(20);
   (*out)[*outsize] = 31; (*outsize)++;  /* ID1 */
   (*out)[*outsize] = 139; (*outsize)++; /* ID2 */
@@ -153,31 +370,30 @@ static void ZopfliGzipCompress(const ZopfliOptions* options,
   (*out)[*outsize] = 2; (*outsize)++;  /* XFL, 2 indicates best compression. */
   (*out)[*outsize] = 3; (*outsize)++;  /* OS follows Unix conventions. */
 
-  ZopfliDeflate(options, 1, in, insize, &bp, out, outsize);
+  DeflateInput(options, input, out, outsize);
   (*out) = (unsigned char*)realloc(*out, *outsize + 8);
 
   /* CRC */
-  *(unsigned*)(&(*out)[*outsize]) = crcvalue; (*outsize) += 4;
+  *(unsigned*)(&(*out)[*outsize]) = input->crc; (*outsize) += 4;
 
-  /* ISIZE */
-  *(unsigned*)(&(*out)[*outsize]) = insize % UINT_MAX; (*outsize) += 4;
+  /* ISIZE, the size modulo 2^32 */
+  *(unsigned*)(&(*out)[*outsize]) = input->size & 0xFFFFFFFFULL; (*outsize) += 4;
 }
 
 static void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_type,
-                    const unsigned char* in, size_t insize, time_t time, std::string name,
-                    unsigned char** out, size_t* outsize) {
+                    ZopfliInput* input, time_t time, std::string name,
+                    unsigned char** out, size_t* outsize, ZopfliOutput* output) {
   if (output_type == ZOPFLI_FORMAT_GZIP) {
-    ZopfliGzipCompress(options, in, insize, time, out, outsize);
+    ZopfliGzipCompress(options, input, time, out, outsize);
   }
   else if (output_type == ZOPFLI_FORMAT_ZIP) {
-    ZopfliZipCompress(options, in, insize, time, name, out, outsize);
+    ZopfliZipCompress(options, input, time, name, out, outsize, output);
   }
   else if (output_type == ZOPFLI_FORMAT_ZLIB) {
     //ZopfliZlibCompress(options, in, insize, out, outsize);
   }
   else if (output_type == ZOPFLI_FORMAT_DEFLATE) {
-    unsigned char bp = 0;
-    ZopfliDeflate(options, 1, in, insize, &bp, out, outsize);
+    DeflateInput(options, input, out, outsize);
   }
 }
 
@@ -211,59 +427,455 @@ static void LoadFile(const char* filename,
 }
 
 /*
- Saves a file from a memory array, overwriting the file if it existed.
+ Maps a file into memory, followed by at least 8 zero bytes as the deflate code
+ reads a little past the end of the input. Returns 0 if the file can't be mapped.
  */
-static void SaveFile(const char* filename,
-                     const unsigned char* in, size_t insize) {
-  FILE* file = fopen(filename, "wb");
-  if (!file){
-    printf ("Can't write to file");
+static unsigned char* MapFile(const char* filename, long long* outsize) {
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  unsigned char* data = 0;
+  struct stat st;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 && (unsigned long long)st.st_size <= SIZE_MAX - 8) {
+    /* Reserve zero pages for the bytes past the end, then map the file over them. */
+    void* region = mmap(0, st.st_size + 8, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region != MAP_FAILED) {
+      if (mmap(region, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        data = (unsigned char*)region;
+        *outsize = st.st_size;
+      }
+      else {
+        munmap(region, st.st_size + 8);
+      }
+    }
   }
-  else {
-    fwrite((char*)in, 1, insize, file);
-    fclose(file);
+  close(fd);
+  return data;
+#else
+  return 0;
+#endif
+}
+
+static void UnmapFile(unsigned char* data, long long size) {
+#ifndef _WIN32
+  munmap(data, size + 8);
+#endif
+}
+
+/*
+Compresses the input to the end of output, writing master blocks as they are
+finished. Returns 1 if the input could not be read completely.
+*/
+static int CompressInput(const ZopfliOptions* options, ZopfliFormat output_type,
+                         ZopfliInput* input, time_t time, const char* name,
+                         ZopfliOutput* output) {
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  ZopfliOptions streamoptions = *options;
+  if (!input->data && options->checkpoint){
+    fprintf(stderr, "%s: Checkpoints are not supported for files this large\n", name);
+    streamoptions.checkpoint = 0;
   }
+  streamoptions.flush = WriteOutput;
+  streamoptions.flushopaque = output;
+  ZopfliCompress(&streamoptions, output_type, input, time, name, &out, &outsize, output);
+  WriteOutput(output, out, outsize);
+  free(out);
+  return input->error;
 }
 
 /*
- outfilename: filename to write output to, or 0 to write to stdout instead
+ outfilename: filename to write output to
+ Returns 1 if the input could not be read completely, 2 if the output can't be
+ written.
  */
-static void CompressFile(const ZopfliOptions* options,
-                         ZopfliFormat output_type,
-                         const char* infilename,
-                         const char* outfilename) {
-  unsigned char* in;
+static int CompressToFile(const ZopfliOptions* options, ZopfliFormat output_type,
+                          ZopfliInput* input, time_t time, const char* name,
+                          const char* outfilename) {
+  ZopfliOutput output;
+  output.written = 0;
+  output.file = fopen(outfilename, "wb");
+  if (!output.file){
+    fprintf(stderr, "Can't write to file\n");
+    return 2;
+  }
+  int error = CompressInput(options, output_type, input, time, name, &output);
+  fclose(output.file);
+  return error;
+}
+
+/* Returns 1 if the input can't be opened or the output can't be written. */
+static int CompressFile(const ZopfliOptions* options,
+                        ZopfliFormat output_type,
+                        const char* infilename,
+                        const char* outfilename) {
   long long insize = -1;
-  unsigned char* out = 0;
-  size_t outsize = 0;
-  LoadFile(infilename, &in, &insize);
+  unsigned char* in = 0;
+  int mapped = 0;
+  ZopfliInput input;
+  input.data = 0;
+  input.file = 0;
+  input.strm = 0;
+  input.next = -1;
+  input.error = 0;
+
+  struct stat st;
+  if (!stat(infilename, &st) && S_ISREG(st.st_mode) && st.st_size >= ZOPFLI_STREAM_SIZE) {
+    input.file = fopen(infilename, "rb");
+    insize = input.file ? st.st_size : -1;
+  }
+  else {
+    in = MapFile(infilename, &insize);
+    mapped = in != 0;
+    if (!mapped) {
+      LoadFile(infilename, &in, &insize);
+    }
+    input.data = in;
+  }
   if (insize < 0) {
     fprintf(stderr, "Invalid filename: %s\n", infilename);
-    return;
+    return 1;
   }
+  input.size = insize;
 
-  struct stat st;
-  stat(infilename, &st);
-  time_t time = st.st_mtime;
-  ZopfliCompress(options, output_type, in, insize, time, infilename, &out, &outsize);
-  free(in);
+  int error = CompressToFile(options, output_type, &input, st.st_mtime, infilename, outfilename);
+  if (error == 1){
+    /* Don't leave a valid looking archive of part of the input behind. */
+    remove(outfilename);
+    fprintf(stderr, "Can't read from file\n");
+    exit(1);
+  }
 
-  SaveFile(outfilename, out, outsize);
+  if (input.file) fclose(input.file);
+  else if (mapped) UnmapFile(in, insize);
+  else free(in);
+  return error != 0;
+}
 
-  free(out);
+static void InitGzipOptions(ZopfliOptions* options, unsigned mode, unsigned multithreading, const char* checkpoint, unsigned chunksize) {
+  ZopfliInitOptions(options, mode, multithreading, 0);
+  options->checkpoint = checkpoint;
+  options->chunksize = chunksize;
 }
 
-int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, unsigned ZIP) {
+int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, unsigned ZIP, const char* checkpoint, unsigned chunksize) {
   ZopfliOptions options;
   //ZopfliFormat output_type = ZOPFLI_FORMAT_GZIP;
   //output_type = ZOPFLI_FORMAT_ZLIB;
   //output_type = ZOPFLI_FORMAT_DEFLATE;
 
-  ZopfliInitOptions(&options, mode, multithreading, 0);
+  InitGzipOptions(&options, mode, multithreading, checkpoint, chunksize);
   //Append ".gz" ".zlib" ".deflate"
 
-  CompressFile(&options, ZIP ? ZOPFLI_FORMAT_ZIP : ZOPFLI_FORMAT_GZIP, filename, outname ? outname : ((std::string)filename).append(ZIP ? ".zip" : ".gz").c_str());
-  return 0;
+  return CompressFile(&options, ZIP ? ZOPFLI_FORMAT_ZIP : ZOPFLI_FORMAT_GZIP, filename, outname ? outname : ((std::string)filename).append(ZIP ? ".zip" : ".gz").c_str());
+}
+
+/* A member of a gzip file. */
+typedef struct GzipMember {
+  size_t start;  /* Offset of the header in the file. */
+  size_t end;  /* Offset past the trailer. */
+  unsigned long long size;  /* Decompressed size. */
+} GzipMember;
+
+/*
+Finds the members of the gzip data. Like gzread, ignores what follows the last
+member if it isn't another one. flags gets the FLG bits of all member headers.
+While the members decompress to less than ZOPFLI_STREAM_SIZE bytes, *data gets
+them concatenated and followed by 8 zero bytes, else it is set to 0.
+Returns 1 if a member is truncated or corrupt.
+*/
+static int GzipMembers(const unsigned char* in, size_t insize, std::vector<GzipMember>* members, unsigned* flags, unsigned char** data) {
+  unsigned char scratch[65536];
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 31) != Z_OK){
+    exit(1);
+  }
+  size_t capacity = 1 << 20;
+  size_t total = 0;
+  *data = (unsigned char*)malloc(capacity + 8);
+  if (!*data){
+    exit(1);
+  }
+  int error = 0;
+  size_t pos = 0;
+  *flags = 0;
+  while (insize - pos > 3 && in[pos] == 31 && in[pos + 1] == 139) {
+    GzipMember member;
+    member.start = pos;
+    member.size = 0;
+    *flags |= in[pos + 3];
+    inflateReset(&strm);
+    int ret;
+    do {
+      if (*data && total == capacity){
+        if (capacity >= ZOPFLI_STREAM_SIZE){
+          //Too large to keep, the caller decompresses again as it goes
+          free(*data);
+          *data = 0;
+        }
+        else {
+          capacity *= 2;
+          *data = (unsigned char*)realloc(*data, capacity + 8);
+          if (!*data){
+            exit(1);
+          }
+        }
+      }
+      unsigned char* out = *data ? *data + total : scratch;
+      size_t avail = *data ? capacity - total : sizeof(scratch);
+      strm.next_in = (Bytef*)(in + pos);
+      strm.avail_in = insize - pos > 0x40000000 ? 0x40000000 : (unsigned)(insize - pos);
+      strm.next_out = out;
+      strm.avail_out = avail;
+      ret = inflate(&strm, Z_NO_FLUSH);
+      pos = strm.next_in - in;
+      member.size += avail - strm.avail_out;
+      total += avail - strm.avail_out;
+    } while (ret == Z_OK);
+    if (ret != Z_STREAM_END){
+      error = 1;
+      break;
+    }
+    member.end = pos;
+    members->push_back(member);
+  }
+  inflateEnd(&strm);
+  if (*data){
+    memset(*data + total, 0, 8);
+  }
+  return error || members->empty();
+}
+
+/* Decompresses a member found by GzipMembers into data, followed by 8 zero bytes. */
+static void InflateMember(const unsigned char* in, const GzipMember* member, unsigned char* data) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 31) != Z_OK){
+    exit(1);
+  }
+  size_t pos = member->start;
+  size_t n = 0;
+  int ret;
+  do {
+    strm.next_in = (Bytef*)(in + pos);
+    strm.avail_in = member->end - pos > 0x40000000 ? 0x40000000 : (unsigned)(member->end - pos);
+    strm.next_out = data + n;
+    strm.avail_out = member->size - n > 0x40000000 ? 0x40000000 : (unsigned)(member->size - n);
+    ret = inflate(&strm, Z_NO_FLUSH);
+    pos = strm.next_in - in;
+    n = strm.next_out - data;
+  } while (ret == Z_OK);
+  inflateEnd(&strm);
+  memset(data + member->size, 0, 8);
+}
+
+/* MTIME of the gzip header at header. */
+static time_t GzipTime(const unsigned char* header) {
+  return header[4] | header[5] << 8 | header[6] << 16 | (time_t)header[7] << 24;
+}
+
+/* Inflates the gzip members in [in, end) while reading from input. */
+static void InflateInput(ZopfliInput* input, z_stream* strm,
+                         const unsigned char* in, const unsigned char* end) {
+  memset(strm, 0, sizeof(*strm));
+  if (inflateInit2(strm, 31) != Z_OK){
+    exit(1);
+  }
+  strm->next_in = (Bytef*)in;
+  input->data = 0;
+  input->file = 0;
+  input->strm = strm;
+  input->end = end;
+  input->next = -1;
+  input->size = 0;
+  input->error = 0;
+}
+
+/*
+Compresses members [first, last) in parallel and writes each one to output
+once those before it are written, so only members finished out of order are
+kept in memory.
+*/
+static void CompressMembers(const ZopfliOptions* options, const unsigned char* in,
+                            const std::vector<GzipMember>& members, size_t first, size_t last,
+                            unsigned char* data, const std::vector<size_t>& offset,
+                            ZopfliOutput* output) {
+  size_t count = last - first;
+  std::vector<unsigned char*> memberout(count, 0);
+  std::vector<size_t> memberoutsize(count, 0);
+  std::vector<char> done(count, 0);
+  size_t written = 0;
+  unsigned threads = options->multithreading > 1 ? options->multithreading : 1;
+  if (threads > count){
+    threads = count;
+  }
+  /* Threads left over once there is one per member go to the members themselves. */
+  ZopfliOptions memberoptions = *options;
+  if (threads > 1){
+    memberoptions.multithreading = options->multithreading / threads;
+    memberoptions.checkpoint = 0;
+  }
+
+#ifndef NOMULTI
+  std::atomic<size_t> next(0);
+  std::mutex writing;
+#else
+  size_t next = 0;
+#endif
+  auto worker = [&]() {
+    for (;;) {
+      size_t k = next++;
+      if (k >= count){
+        return;
+      }
+      const GzipMember* member = &members[first + k];
+      unsigned char* memberdata = 0;
+      if (!data){
+        memberdata = (unsigned char*)malloc(member->size + 8);
+        if (!memberdata){
+          exit(1);
+        }
+        InflateMember(in, member, memberdata);
+      }
+      ZopfliInput input;
+      input.data = data ? data + offset[first + k] : memberdata;
+      input.file = 0;
+      input.strm = 0;
+      input.next = -1;
+      input.size = member->size;
+      input.error = 0;
+      ZopfliGzipCompress(&memberoptions, &input, GzipTime(in + member->start), &memberout[k], &memberoutsize[k]);
+      free(memberdata);
+
+#ifndef NOMULTI
+      std::lock_guard<std::mutex> lock(writing);
+#endif
+      done[k] = 1;
+      while (written < count && done[written]) {
+        WriteOutput(output, memberout[written], memberoutsize[written]);
+        free(memberout[written]);
+        written++;
+      }
+    }
+  };
+#ifndef NOMULTI
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++) {
+    workers.emplace_back(worker);
+  }
+#endif
+  worker();
+#ifndef NOMULTI
+  for (std::thread& t : workers) {
+    t.join();
+  }
+#endif
+}
+
+/*
+Recompresses every member of the gzip data on its own, keeping each one's
+MTIME. With multithreading, members are compressed in parallel. data is the
+decompressed data from GzipMembers, or 0 to decompress each member again.
+Members of ZOPFLI_STREAM_SIZE bytes or more are then streamed one at a time.
+Returns 1 if a member can't be decompressed, 2 if the output can't be written.
+*/
+static int RecompressMembers(const ZopfliOptions* options, const char* name, const unsigned char* in,
+                             const std::vector<GzipMember>& members, unsigned char* data,
+                             const char* outfilename) {
+  ZopfliOutput output;
+  output.written = 0;
+  output.file = fopen(outfilename, "wb");
+  if (!output.file){
+    fprintf(stderr, "Can't write to file\n");
+    return 2;
+  }
+  size_t nmembers = members.size();
+  std::vector<size_t> offset(nmembers, 0);
+  for (size_t k = 1; k < nmembers; k++) {
+    offset[k] = offset[k - 1] + members[k - 1].size;
+  }
+  int error = 0;
+  size_t k = 0;
+  while (k < nmembers && !error) {
+    if (!data && members[k].size >= ZOPFLI_STREAM_SIZE){
+      ZopfliInput input;
+      z_stream strm;
+      InflateInput(&input, &strm, in + members[k].start, in + members[k].end);
+      error = CompressInput(options, ZOPFLI_FORMAT_GZIP, &input, GzipTime(in + members[k].start), name, &output);
+      inflateEnd(&strm);
+      k++;
+      continue;
+    }
+    size_t last = k + 1;
+    while (last < nmembers && (data || members[last].size < ZOPFLI_STREAM_SIZE)) {
+      last++;
+    }
+    CompressMembers(options, in, members, k, last, data, offset, &output);
+    k = last;
+  }
+  fclose(output.file);
+  return error;
+}
+
+int ZopfliRecompressGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, const char* checkpoint, unsigned chunksize, unsigned members, int strict) {
+  ZopfliOptions options;
+  InitGzipOptions(&options, mode, multithreading, checkpoint, chunksize);
+
+  long long insize = -1;
+  unsigned char* in = MapFile(filename, &insize);
+  int mapped = in != 0;
+  if (!mapped){
+    LoadFile(filename, &in, &insize);
+  }
+  if (insize < 0){
+    return 1;
+  }
+  std::vector<GzipMember> gzmembers;
+  unsigned flags;
+  unsigned char* data;
+  int error = GzipMembers(in, insize, &gzmembers, &flags, &data);
+  if (error){
+    printf("%s: ungzip error\n", filename);
+  }
+  else if (strict && (flags & 0x1c)){
+    printf("%s: File includes extra field, file name or comment, can't be optimized in strict mode\n", filename);
+    error = 1;
+  }
+  else {
+    if (members && gzmembers.size() > 1){
+      error = RecompressMembers(&options, filename, in, gzmembers, data, outname);
+    }
+    else {
+      ZopfliInput input;
+      z_stream strm;
+      if (data){
+        input.data = data;
+        input.file = 0;
+        input.strm = 0;
+        input.next = -1;
+        input.size = 0;
+        input.error = 0;
+        for (size_t k = 0; k < gzmembers.size(); k++) {
+          input.size += gzmembers[k].size;
+        }
+      }
+      else {
+        //Too large to keep in memory, decompress again while compressing
+        InflateInput(&input, &strm, in, in + gzmembers.back().end);
+      }
+      //Merged output keeps the modification time of the first header
+      error = CompressToFile(&options, ZOPFLI_FORMAT_GZIP, &input, GzipTime(in), filename, outname);
+      if (!data) inflateEnd(&strm);
+    }
+    if (error == 1){
+      printf("%s: ungzip error\n", filename);
+    }
+  }
+  free(data);
+  if (mapped) UnmapFile(in, insize);
+  else free(in);
+  return error;
 }
 
 void ZopfliBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize) {